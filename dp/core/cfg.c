@@ -37,21 +37,35 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <libconfig.h>	/* provides hierarchical config file parsing */
+#include <numa.h>
 
 #include <ix/errno.h>
 #include <ix/log.h>
 #include <ix/types.h>
 #include <ix/cfg.h>
 #include <ix/cpu.h>
+#include <ix/timer.h>
+#include <ix/policy.h>
+#include <ix/dispatch.h>
 
 #include <net/ethernet.h>
 #include <net/ip.h>
 #include <ix/ethdev.h>
 
 #define DEFAULT_CONF_FILE "./shinjuku.conf"
+#define DEFAULT_MLFQ_AGING 1000000 /* ns */
+#define DEFAULT_PREEMPT_RESEND 20000 /* ns */
+#define DEFAULT_QUANTUM   5000 /* ns */
+#define DEFAULT_STACK_SIZE 2048
+#define MIN_STACK_SIZE     1024
+#define MAX_STACK_SIZE     (1 << 20)
 
 struct cfg_parameters CFG;
 
+/* number of cpus given per role by explicit role lists; -1 if not used */
+static int role_dispatchers = -1;
+static int role_networkers = -1;
+
 extern int net_cfg(void);
 extern int arp_insert(struct ip_addr *addr, struct eth_addr *mac);
 
@@ -61,11 +75,28 @@ static char config_file[256];
 static int parse_host_addr(void);
 static int parse_port(void);
 static int parse_slo(void);
+static int parse_quantum(void);
+static int parse_budget(void);
+static int parse_stacks(void);
+static int parse_adaptive_quantum(void);
+static int parse_urgent_preemption(void);
+static int parse_preempt_resend(void);
+static int parse_preemption(void);
+static int parse_admission_factor(void);
+static int parse_mlfq(void);
+static int parse_affinity_window(void);
+static int parse_batch(void);
+static int parse_parking(void);
 static int parse_gateway_addr(void);
 static int parse_arp(void);
 static int parse_devices(void);
 static int parse_cpu(void);
+static int parse_dispatchers(void);
+static int parse_handoff_depth(void);
+static int parse_partitions(void);
+static int parse_policy(void);
 static int parse_loader_path(void);
+static int parse_handler_path(void);
 
 struct config_vector_t {
 	const char *name;
@@ -76,11 +107,28 @@ static struct config_vector_t config_tbl[] = {
 	{ "host_addr",    parse_host_addr},
 	{ "port",         parse_port},
 	{ "slo",          parse_slo},
+	{ "quantum",      parse_quantum},
+	{ "budget",       parse_budget},
+	{ "stack_size",   parse_stacks},
+	{ "adaptive_quantum", parse_adaptive_quantum},
+	{ "urgent_preemption", parse_urgent_preemption},
+	{ "preempt_resend", parse_preempt_resend},
+	{ "preemption",   parse_preemption},	// after urgent_preemption
+	{ "admission_factor", parse_admission_factor},
+	{ "mlfq_levels",  parse_mlfq},		// after quantum
+	{ "affinity_window", parse_affinity_window},
+	{ "batch_size",   parse_batch},
+	{ "park_idle",    parse_parking},
 	{ "gateway_addr", parse_gateway_addr},
 	{ "arp",          parse_arp},
 	{ "devices",      parse_devices},
 	{ "cpu",          parse_cpu},
+	{ "dispatchers",  parse_dispatchers},	// after cpu
+	{ "handoff_depth", parse_handoff_depth},
+	{ "reserve",      parse_partitions},	// after dispatchers
+	{ "policy",       parse_policy},
 	{ "loader_path",  parse_loader_path},
+	{ "handler_path", parse_handler_path},
 	{ NULL,           NULL}
 };
 
@@ -198,7 +246,14 @@ static int parse_port(void)
 
 static int add_slo(int slo)
 {
-	CFG.slos[CFG.num_slos] = 2.5 * slo;
+	uint64_t cycles = ns_to_cycles(slo);
+
+	if (slo <= 0 || !cycles) {
+		log_err("cfg: invalid slo %d\n", slo);
+		return -EINVAL;
+	}
+	CFG.slos[CFG.num_slos] = cycles;
+	CFG.slo_recip[CFG.num_slos] = ((uint64_t) SLO_RECIP_SCALE << 32) / cycles;
 	++CFG.num_slos;
 	return 0;
 }
@@ -225,6 +280,284 @@ static int parse_slo(void)
 	return 0;
 }
 
+static int set_quantum(int type, int quantum)
+{
+	if (quantum <= 0) {
+		log_err("cfg: invalid quantum %d for type %d\n", quantum, type);
+		return -EINVAL;
+	}
+	CFG.quanta[type] = ns_to_cycles(quantum);
+	return 0;
+}
+
+/*
+ * The quantum is optional: a single value applies to every type, a list
+ * sets the types in order and the remaining types keep the default.
+ */
+static int parse_quantum(void)
+{
+	const config_setting_t *quanta = NULL;
+	int i, quantum = DEFAULT_QUANTUM, ret;
+
+	quanta = config_lookup(&cfg, "quantum");
+	if (quanta && !config_setting_get_elem(quanta, 0))
+		quantum = config_setting_get_int(quanta);
+	for (i = 0; i < CFG_MAX_PORTS; i++) {
+		ret = set_quantum(i, quantum);
+		if (ret)
+			return ret;
+	}
+	if (!quanta || !config_setting_get_elem(quanta, 0))
+		return 0;
+	for (i = 0; i < CFG_MAX_PORTS && i < config_setting_length(quanta); i++) {
+		quantum = config_setting_get_int_elem(quanta, i);
+		ret = set_quantum(i, quantum);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * The budget is optional: a single value applies to every type, a list sets
+ * the types in order. Types without a budget never expire.
+ */
+static int parse_budget(void)
+{
+	const config_setting_t *budgets = NULL;
+	int i, budget;
+
+	budgets = config_lookup(&cfg, "budget");
+	if (!budgets)
+		return 0;
+	if (!config_setting_get_elem(budgets, 0)) {
+		budget = config_setting_get_int(budgets);
+		if (budget <= 0) {
+			log_err("cfg: invalid budget %d\n", budget);
+			return -EINVAL;
+		}
+		for (i = 0; i < CFG_MAX_PORTS; i++)
+			CFG.budgets[i] = ns_to_cycles(budget);
+		return 0;
+	}
+	for (i = 0; i < CFG_MAX_PORTS && i < config_setting_length(budgets); i++) {
+		budget = config_setting_get_int_elem(budgets, i);
+		if (budget < 0) {
+			log_err("cfg: invalid budget %d for type %d\n", budget, i);
+			return -EINVAL;
+		}
+		CFG.budgets[i] = ns_to_cycles(budget);
+	}
+	return 0;
+}
+
+static int parse_stacks(void)
+{
+	const config_setting_t *sizes = NULL;
+	int i, n = 0, size[CFG_MAX_PORTS];
+
+	for (i = 0; i < CFG_MAX_PORTS; i++)
+		size[i] = DEFAULT_STACK_SIZE;
+	sizes = config_lookup(&cfg, "stack_size");
+	if (sizes && !config_setting_get_elem(sizes, 0)) {
+		size[0] = config_setting_get_int(sizes);
+		for (i = 1; i < CFG_MAX_PORTS; i++)
+			size[i] = size[0];
+		n = CFG_MAX_PORTS;
+	} else if (sizes) {
+		n = config_setting_length(sizes);
+		for (i = 0; i < CFG_MAX_PORTS && i < n; i++)
+			size[i] = config_setting_get_int_elem(sizes, i);
+	}
+	for (i = 0; i < CFG_MAX_PORTS; i++) {
+		if (size[i] < MIN_STACK_SIZE || size[i] > MAX_STACK_SIZE) {
+			log_err("cfg: invalid stack size %d for type %d "
+				"(min:%d max:%d)\n", size[i], i, MIN_STACK_SIZE,
+				MAX_STACK_SIZE);
+			return -EINVAL;
+		}
+		CFG.stack_sizes[i] = size[i];
+	}
+	return 0;
+}
+
+static int parse_adaptive_quantum(void)
+{
+	int adaptive = 0;
+
+	config_lookup_bool(&cfg, "adaptive_quantum", &adaptive);
+	CFG.adaptive_quantum = adaptive;
+	return 0;
+}
+
+static int parse_urgent_preemption(void)
+{
+	int urgent = 0;
+
+	config_lookup_bool(&cfg, "urgent_preemption", &urgent);
+	CFG.urgent_preemption = urgent;
+	return 0;
+}
+
+static int parse_preempt_resend(void)
+{
+	int resend = DEFAULT_PREEMPT_RESEND;
+
+	config_lookup_int(&cfg, "preempt_resend", &resend);
+	if (resend < 0) {
+		log_err("cfg: invalid preemption re-send timeout %d\n", resend);
+		return -EINVAL;
+	}
+	CFG.preempt_resend = ns_to_cycles(resend);
+	return 0;
+}
+
+static int parse_preemption(void)
+{
+	const char *parsed = NULL;
+
+	config_lookup_string(&cfg, "preemption", &parsed);
+	if (!parsed || !strcmp(parsed, "ipi")) {
+		CFG.preempt_mode = PREEMPT_MODE_IPI;
+		return 0;
+	}
+	if (!strcmp(parsed, "timer"))
+		CFG.preempt_mode = PREEMPT_MODE_TIMER;
+	else if (!strcmp(parsed, "cooperative"))
+		CFG.preempt_mode = PREEMPT_MODE_COOPERATIVE;
+	else {
+		log_err("cfg: unknown preemption mode '%s'\n", parsed);
+		return -EINVAL;
+	}
+	if (CFG.preempt_mode == PREEMPT_MODE_COOPERATIVE &&
+	    CFG.urgent_preemption) {
+		log_err("cfg: urgent_preemption needs interrupts\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int parse_admission_factor(void)
+{
+	int factor = 0;
+
+	config_lookup_int(&cfg, "admission_factor", &factor);
+	if (factor < 0) {
+		log_err("cfg: invalid admission factor %d\n", factor);
+		return -EINVAL;
+	}
+	CFG.admission_factor = factor;
+	return 0;
+}
+
+static int parse_batch(void)
+{
+	int size = 1, threshold = 0;
+
+	config_lookup_int(&cfg, "batch_size", &size);
+	config_lookup_int(&cfg, "batch_threshold", &threshold);
+	if (size < 1 || size > CFG_MAX_BATCH) {
+		log_err("cfg: invalid batch size %d (max:%d)\n", size,
+			CFG_MAX_BATCH);
+		return -EINVAL;
+	}
+	if (threshold < 0) {
+		log_err("cfg: invalid batch threshold %d\n", threshold);
+		return -EINVAL;
+	}
+	CFG.batch_size = size;
+	CFG.batch_threshold = ns_to_cycles(threshold);
+	return 0;
+}
+
+static int parse_parking(void)
+{
+	int idle = 0, min = 1, mwait = 0;
+
+	config_lookup_int(&cfg, "park_idle", &idle);
+	config_lookup_int(&cfg, "min_workers", &min);
+	config_lookup_bool(&cfg, "park_mwait", &mwait);
+	if (idle < 0) {
+		log_err("cfg: invalid park_idle %d\n", idle);
+		return -EINVAL;
+	}
+	if (min < 1) {
+		log_err("cfg: invalid min_workers %d (min:1)\n", min);
+		return -EINVAL;
+	}
+	CFG.park_idle = ns_to_cycles(idle);
+	CFG.min_workers = min;
+	CFG.park_mwait = mwait;
+	return 0;
+}
+
+/*
+ * Level 0 of the feedback queue is made of the per type queues and uses the
+ * per type quanta. 'mlfq_quanta' sets the quanta of the lower levels in
+ * order, starting at level 1. A level it does not cover gets four times the
+ * quantum of the level above, the largest per type quantum for level 1, so
+ * that no type gets a shorter quantum after a demotion.
+ */
+static int parse_mlfq(void)
+{
+	const config_setting_t *quanta = NULL;
+	int i, n = 0, levels = 0, aging = DEFAULT_MLFQ_AGING, quantum;
+
+	config_lookup_int(&cfg, "mlfq_levels", &levels);
+	if (levels < 0 || levels > CFG_MAX_MLFQ_LEVELS) {
+		log_err("cfg: invalid number of mlfq levels %d (max:%d)\n",
+			levels, CFG_MAX_MLFQ_LEVELS);
+		return -EINVAL;
+	}
+	CFG.mlfq_levels = levels;
+	if (levels < 2)
+		return 0;
+
+	CFG.mlfq_quanta[0] = CFG.quanta[0];
+	for (i = 1; i < CFG.num_ports; i++) {
+		if (CFG.quanta[i] > CFG.mlfq_quanta[0])
+			CFG.mlfq_quanta[0] = CFG.quanta[i];
+	}
+
+	quanta = config_lookup(&cfg, "mlfq_quanta");
+	if (quanta)
+		n = config_setting_length(quanta);
+	for (i = 1; i < CFG_MAX_MLFQ_LEVELS; i++) {
+		if (i >= levels || i > n) {
+			CFG.mlfq_quanta[i] = CFG.mlfq_quanta[i - 1] * 4;
+			continue;
+		}
+		quantum = config_setting_get_int_elem(quanta, i - 1);
+		if (quantum <= 0) {
+			log_err("cfg: invalid mlfq quantum %d for level %d\n",
+				quantum, i);
+			return -EINVAL;
+		}
+		CFG.mlfq_quanta[i] = ns_to_cycles(quantum);
+	}
+
+	config_lookup_int(&cfg, "mlfq_aging", &aging);
+	if (aging < 0) {
+		log_err("cfg: invalid mlfq aging %d\n", aging);
+		return -EINVAL;
+	}
+	CFG.mlfq_aging = ns_to_cycles(aging);
+	return 0;
+}
+
+static int parse_affinity_window(void)
+{
+	int window = 0;
+
+	config_lookup_int(&cfg, "affinity_window", &window);
+	if (window < 0) {
+		log_err("cfg: invalid affinity window %d\n", window);
+		return -EINVAL;
+	}
+	CFG.affinity_window = ns_to_cycles(window);
+	return 0;
+}
+
 static int parse_host_addr(void)
 {
 	char *parsed = NULL, *ip = NULL, *bitmask = NULL;
@@ -309,13 +642,147 @@ static int add_cpu(int cpu)
 	return 0;
 }
 
+static int parse_cpu_list(const char *name, int *cpus)
+{
+	const config_setting_t *list = NULL;
+	int i;
+
+	list = config_lookup(&cfg, name);
+	if (!list)
+		return 0;
+	if (!config_setting_is_aggregate(list)) {
+		cpus[0] = config_setting_get_int(list);
+		return 1;
+	}
+	if (config_setting_length(list) > CFG_MAX_CPU)
+		return -E2BIG;
+	for (i = 0; i < config_setting_length(list); i++)
+		cpus[i] = config_setting_get_int_elem(list, i);
+	return i;
+}
+
+static int add_role_cpu(int cpu, const char *role)
+{
+	int num_cpus = CFG.num_cpus, ret;
+
+	ret = add_cpu(cpu);
+	if (ret)
+		return ret;
+	if (CFG.num_cpus == num_cpus) {
+		log_err("cfg: cpu %d is given more than one role (%s)\n", cpu,
+			role);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int dev_numa_node(const struct pci_addr *addr)
+{
+	char path[128];
+	FILE *f;
+	int node = -1;
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/pci/devices/%04x:%02x:%02x.%d/numa_node",
+		 addr->domain, addr->bus, addr->slot, addr->func);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+/*
+ * The dispatcher and networker touch every packet and should share the NIC's
+ * NUMA node; workers may be spread on purpose, so their layout is only
+ * reported.
+ */
+static void check_roles_numa(void)
+{
+	int i, node, nic_node, per_node[CFG_MAX_CPU] = {0};
+	int first_worker = role_dispatchers + role_networkers;
+
+	if (numa_available() < 0 || !CFG.num_ethdev)
+		return;
+	nic_node = dev_numa_node(&CFG.ethdev[0]);
+	for (i = 0; i < first_worker; i++) {
+		node = numa_node_of_cpu(CFG.cpu[i]);
+		if (nic_node >= 0 && node != nic_node)
+			log_warn("cfg: %s cpu %d is on NUMA node %d, the NIC on "
+				 "node %d\n",
+				 (i == 1 && role_networkers) ? "networker" :
+				 "dispatcher", CFG.cpu[i], node, nic_node);
+	}
+	for (i = first_worker; i < CFG.num_cpus; i++) {
+		node = numa_node_of_cpu(CFG.cpu[i]);
+		if (node >= 0 && node < CFG_MAX_CPU)
+			per_node[node]++;
+	}
+	for (i = 0; i < CFG_MAX_CPU; i++)
+		if (per_node[i])
+			log_info("cfg: %d workers on NUMA node %d\n",
+				 per_node[i], i);
+}
+
+/*
+ * Explicit role lists are laid out in CFG.cpu in the order the rest of the
+ * code expects: first dispatcher, networker, other dispatchers, workers.
+ */
+static int parse_roles(void)
+{
+	int dispatchers[CFG_MAX_CPU], networkers[CFG_MAX_CPU];
+	int workers[CFG_MAX_CPU];
+	int nd, nn, nw, i, ret;
+
+	nd = parse_cpu_list("dispatcher_cpus", dispatchers);
+	nn = parse_cpu_list("networker_cpus", networkers);
+	nw = parse_cpu_list("worker_cpus", workers);
+	if (nd < 0 || nn < 0 || nw < 0)
+		return -E2BIG;
+	if (nd < 1 || nw < 1) {
+		log_err("cfg: role lists need a dispatcher and workers\n");
+		return -EINVAL;
+	}
+	if (nn > 1) {
+		log_err("cfg: only one networker is supported\n");
+		return -EINVAL;
+	}
+
+	ret = add_role_cpu(dispatchers[0], "dispatcher");
+	for (i = 0; !ret && i < nn; i++)
+		ret = add_role_cpu(networkers[i], "networker");
+	for (i = 1; !ret && i < nd; i++)
+		ret = add_role_cpu(dispatchers[i], "dispatcher");
+	for (i = 0; !ret && i < nw; i++)
+		ret = add_role_cpu(workers[i], "worker");
+	if (ret)
+		return ret;
+
+	role_dispatchers = nd;
+	role_networkers = nn;
+	check_roles_numa();
+	return 0;
+}
+
 static int parse_cpu(void)
 {
 	int i, ret, cpu = -1;
+	bool roles;
 	config_setting_t *cpus = NULL;
 
+	roles = config_lookup(&cfg, "dispatcher_cpus") ||
+		config_lookup(&cfg, "networker_cpus") ||
+		config_lookup(&cfg, "worker_cpus");
 	cpus = config_lookup(&cfg, "cpu");
+	if (cpus && roles) {
+		log_err("cfg: cpu and the role lists are mutually exclusive\n");
+		return -EINVAL;
+	}
 	if (!cpus) {
+		if (roles)
+			return parse_roles();
 		return -EINVAL;
 	}
 	if (!config_setting_get_elem(cpus, 0)) {
@@ -332,6 +799,125 @@ static int parse_cpu(void)
 	return 0;
 }
 
+static int parse_dispatchers(void)
+{
+	int dispatchers = 1, fused = 0, networkers;
+
+	if (role_dispatchers > 0) {
+		dispatchers = role_dispatchers;
+		fused = !role_networkers;
+	}
+	config_lookup_int(&cfg, "dispatchers", &dispatchers);
+	config_lookup_bool(&cfg, "fused_networker", &fused);
+	if (role_dispatchers > 0 && (dispatchers != role_dispatchers ||
+				     fused != !role_networkers)) {
+		log_err("cfg: dispatchers/fused_networker disagree with the "
+			"role lists\n");
+		return -EINVAL;
+	}
+	if (dispatchers < 1 || dispatchers > CFG_MAX_DISPATCHERS) {
+		log_err("cfg: invalid number of dispatchers %d (min:1 max:%d)\n",
+			dispatchers, CFG_MAX_DISPATCHERS);
+		return -EINVAL;
+	}
+	if (fused && dispatchers > 1) {
+		log_err("cfg: fused_networker needs a single dispatcher\n");
+		return -EINVAL;
+	}
+	networkers = fused ? 0 : 1;
+	/* every shard needs at least one worker */
+	if (CFG.num_cpus - networkers - dispatchers < dispatchers) {
+		log_err("cfg: %d cpus are not enough for %d dispatchers\n",
+			CFG.num_cpus, dispatchers);
+		return -EINVAL;
+	}
+	CFG.num_dispatchers = dispatchers;
+	CFG.fused_networker = fused;
+	return 0;
+}
+
+static int parse_handoff_depth(void)
+{
+	int depth = 1;
+
+	config_lookup_int(&cfg, "handoff_depth", &depth);
+	if (depth < 1 || depth > CFG_MAX_HANDOFF_DEPTH || (depth & (depth - 1))) {
+		log_err("cfg: invalid handoff depth %d (power of two, max:%d)\n",
+			depth, CFG_MAX_HANDOFF_DEPTH);
+		return -EINVAL;
+	}
+	CFG.handoff_depth = depth;
+	return 0;
+}
+
+static int parse_type_list(const char *name, int *values)
+{
+	const config_setting_t *list = NULL;
+	int i;
+
+	list = config_lookup(&cfg, name);
+	if (!list)
+		return 0;
+	for (i = 0; i < CFG_MAX_PORTS && i < config_setting_length(list); i++) {
+		values[i] = config_setting_get_int_elem(list, i);
+		if (values[i] < 0) {
+			log_err("cfg: invalid %s %d for type %d\n", name,
+				values[i], i);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reservations and caps apply to every shard: the first reserve[0] workers
+ * of a shard only run type 0, the next reserve[1] only type 1, and so on.
+ */
+static int parse_partitions(void)
+{
+	int i, ret, reserved = 0, borrow = 1;
+	int shard_workers = num_workers() / CFG.num_dispatchers;
+
+	ret = parse_type_list("reserve", CFG.reserve);
+	if (ret)
+		return ret;
+	ret = parse_type_list("type_caps", CFG.type_caps);
+	if (ret)
+		return ret;
+	config_lookup_bool(&cfg, "borrow", &borrow);
+	CFG.borrow = borrow;
+
+	for (i = 0; i < CFG_MAX_PORTS; i++)
+		reserved += CFG.reserve[i];
+	if (reserved > shard_workers ||
+	    (reserved == shard_workers && !CFG.borrow)) {
+		log_err("cfg: %d reserved workers leave no shared worker in "
+			"shards of %d\n", reserved, shard_workers);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int parse_policy(void)
+{
+	const char *parsed = NULL;
+	const struct sched_policy *policy;
+
+	config_lookup_string(&cfg, "policy", &parsed);
+	if (!parsed) {
+		log_info("cfg: using default '%s' scheduling policy\n",
+			 sched_policy->name);
+		return 0;
+	}
+	policy = policy_find(parsed);
+	if (!policy) {
+		log_err("cfg: unknown scheduling policy '%s'\n", parsed);
+		return -EINVAL;
+	}
+	sched_policy = policy;
+	return 0;
+}
+
 static int parse_loader_path(void)
 {
 	char *parsed = NULL;
@@ -344,6 +930,21 @@ static int parse_loader_path(void)
 	return 0;
 }
 
+static int parse_handler_path(void)
+{
+	const char *parsed = NULL;
+
+	config_lookup_string(&cfg, "handler_path", &parsed);
+	if (!parsed)
+		return 0;
+	if (strlen(parsed) >= sizeof(CFG.handler_path)) {
+		log_err("cfg: handler_path is too long\n");
+		return -EINVAL;
+	}
+	strcpy(CFG.handler_path, parsed);
+	return 0;
+}
+
 static int parse_conf_file(const char *path)
 {
 	int ret, i;
@@ -24,26 +24,183 @@
  * context.c - context management
  */
 
-#include <ucontext.h>
+#include <stdlib.h>
 
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/log.h>
 #include <ix/stddef.h>
 #include <ix/context.h>
 #include <ix/mempool.h>
 
 #define CONTEXT_CAPACITY    768*1024
 #define STACK_CAPACITY      768*1024
-#define STACK_SIZE          2048
+/* stack memory shared by all classes */
+#define STACK_MEMORY        (STACK_CAPACITY * 2048UL)
 
-static int context_init_mempool(void)
+DEFINE_PERCPU(struct mempool, context_pool __attribute__((aligned(64))));
+uint64_t xstate_mask;
+unsigned int xstate_size;
+enum xstate_insn xstate_insn;
+bool xstate_xinuse;
+
+#define CPUID1_ECX_XSAVE        (1 << 26)
+#define CPUID1_ECX_OSXSAVE      (1 << 27)
+#define CPUIDD1_EAX_XSAVEOPT    (1 << 0)
+#define CPUIDD1_EAX_XSAVEC      (1 << 1)
+#define CPUIDD1_EAX_XINUSE      (1 << 2)
+
+/* x87, SSE, AVX and AVX-512 state; AMX tiles are not supported */
+#define XSTATE_SUPPORTED        0xe7UL
+#define XSTATE_LEGACY_SIZE      576     /* legacy area and header */
+DEFINE_PERCPU(struct mempool,
+              stack_pools[CFG_MAX_PORTS] __attribute__((aligned(64))));
+unsigned int nr_stack_classes;
+uint8_t stack_class_of[CFG_MAX_PORTS];
+uint32_t stack_class_size[CFG_MAX_PORTS];
+static unsigned long stack_overflows;
+
+#ifdef ENABLE_KSTATS
+#define BENCH_SWITCHES      (1 << 20)
+
+static struct context bench_main, bench_cont;
+
+static void bench_loop(void * arg0, void * arg1)
 {
-        struct mempool *m = &context_pool;
-        return mempool_create(m, &context_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+        while (true)
+                swapcontext_very_fast(&bench_cont, &bench_main);
 }
 
-static int stack_init_mempool(void)
+/*
+ * Logs the cost of a round trip into a context and back, the path a worker
+ * takes for every request.
+ */
+static void context_switch_bench(void)
 {
-        struct mempool *m = &stack_pool;
-        return mempool_create(m, &stack_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+        int i;
+        uint64_t start;
+
+        bench_cont.stack = aligned_alloc(16, stack_class_size[0]);
+        if (!bench_cont.stack)
+                return;
+        bench_cont.stack_class = 0;
+        context_make(&bench_cont, bench_loop, NULL, NULL);
+        start = rdtsc();
+        for (i = 0; i < BENCH_SWITCHES; i++)
+                swapcontext_very_fast(&bench_main, &bench_cont);
+        log_info("context: %lu cycles per round trip, %lu bytes per context\n",
+                 (rdtsc() - start) / BENCH_SWITCHES, sizeof(struct context));
+        free(bench_cont.stack);
+}
+#endif
+
+/*
+ * Preempted contexts keep their vector registers in their context object, so
+ * contexts are sized for the state components the OS enabled in XCR0.
+ */
+static void xstate_init(void)
+{
+        unsigned int a, b, c, d, i;
+
+        cpuid(1, &a, &b, &c, &d);
+        if (!(c & CPUID1_ECX_XSAVE) || !(c & CPUID1_ECX_OSXSAVE)) {
+                log_warn("context: no XSAVE, vector state is not preserved "
+                         "across preemption\n");
+                return;
+        }
+        xstate_mask = xgetbv(0) & XSTATE_SUPPORTED;
+        /* the standard layout bounds the compacted one */
+        xstate_size = XSTATE_LEGACY_SIZE;
+        for (i = 2; i < 64; i++) {
+                if (!(xstate_mask & (1UL << i)))
+                        continue;
+                cpuid_count(0xd, i, &a, &b, &c, &d);
+                if (b + a > xstate_size)
+                        xstate_size = b + a;
+        }
+        cpuid_count(0xd, 1, &a, &b, &c, &d);
+        if (a & CPUIDD1_EAX_XSAVEC)
+                xstate_insn = XSTATE_XSAVEC;
+        else if (a & CPUIDD1_EAX_XSAVEOPT)
+                xstate_insn = XSTATE_XSAVEOPT;
+        else
+                xstate_insn = XSTATE_XSAVE;
+        xstate_xinuse = a & CPUIDD1_EAX_XINUSE;
+        log_info("context: saving xstate %lx, %u bytes, insn %d, xinuse %d\n",
+                 xstate_mask, xstate_size, xstate_insn, xstate_xinuse);
+}
+
+/**
+ * context_stack_overflow - reports a stack whose canary was overwritten
+ * @c: the context being freed
+ */
+void context_stack_overflow(struct context *c)
+{
+        stack_overflows++;
+        log_err("context: stack overflow by a request of type %d, stack size "
+                "%u, %lu overflows so far\n", c->type,
+                stack_class_size[c->stack_class], stack_overflows);
+        *(uint64_t *) c->stack = STACK_CANARY;
+}
+
+/**
+ * context_init_cpu - creates the per cpu context and stack mempools
+ */
+int context_init_cpu(void)
+{
+        int ret;
+        unsigned int i;
+
+        ret = mempool_create(&percpu_get(context_pool), &context_datastore,
+                             MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+        if (ret)
+                return ret;
+
+        for (i = 0; i < nr_stack_classes; i++) {
+                ret = mempool_create(&percpu_get(stack_pools)[i],
+                                     &stack_datastores[i],
+                                     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+                if (ret)
+                        return ret;
+        }
+        return 0;
+}
+
+/*
+ * Groups the request types by stack size and creates a datastore for each
+ * size. The classes split STACK_MEMORY evenly, and never get more than
+ * their share of STACK_CAPACITY stacks.
+ */
+static int stack_classes_init(void)
+{
+        int ret;
+        unsigned int i, j, nr_elems;
+        size_t elem_len;
+
+        for (i = 0; i < CFG_MAX_PORTS; i++) {
+                for (j = 0; j < nr_stack_classes; j++)
+                        if (stack_class_size[j] == CFG.stack_sizes[i])
+                                break;
+                if (j == nr_stack_classes)
+                        stack_class_size[nr_stack_classes++] =
+                                CFG.stack_sizes[i];
+                stack_class_of[i] = j;
+        }
+
+        for (i = 0; i < nr_stack_classes; i++) {
+                elem_len = stack_class_size[i];
+                nr_elems = min((unsigned long) STACK_CAPACITY,
+                               STACK_MEMORY / elem_len) / nr_stack_classes;
+                nr_elems = max(nr_elems / MEMPOOL_DEFAULT_CHUNKSIZE, 1U) *
+                           MEMPOOL_DEFAULT_CHUNKSIZE;
+                ret = mempool_create_datastore(&stack_datastores[i], nr_elems,
+                                               elem_len, 1,
+                                               MEMPOOL_DEFAULT_CHUNKSIZE,
+                                               "stack");
+                if (ret)
+                        return ret;
+        }
+        return 0;
 }
 
 /**
@@ -52,23 +209,26 @@ static int stack_init_mempool(void)
 int context_init(void)
 {
         int ret;
+
+        /* offsets used by context_fast.S */
+        BUILD_ASSERT(offsetof(struct context, rsp) == 0x30);
+        BUILD_ASSERT(offsetof(struct context, rip) == 0x38);
+        BUILD_ASSERT(offsetof(struct context, mxcsr) == 0x40);
+        BUILD_ASSERT(offsetof(struct context, fpucw) == 0x44);
+
+        xstate_init();
         ret = mempool_create_datastore(&context_datastore, CONTEXT_CAPACITY,
-                                       sizeof(ucontext_t), 1,
+                                       sizeof(struct context) +
+                                       (xstate_size ? xstate_size + 63 : 0), 1,
                                        MEMPOOL_DEFAULT_CHUNKSIZE,
                                        "context");
         if (ret)
                 return ret;
 
-        ret = context_init_mempool();
-        if (ret)
-                return ret;
-
-        ret = mempool_create_datastore(&stack_datastore, STACK_CAPACITY,
-                                       STACK_SIZE, 1, MEMPOOL_DEFAULT_CHUNKSIZE,
-                                       "stack");
-        if (ret)
-                return ret;
-
-        ret = stack_init_mempool();
+        ret = stack_classes_init();
+#ifdef ENABLE_KSTATS
+        if (!ret)
+                context_switch_bench();
+#endif
         return ret;
 }
@@ -21,7 +21,7 @@
 
 # Makefile for the core system
 
-SRC = ethdev.c ethfg.c ethqueue.c cfg.c control_plane.c cpu.c init.c log.c mbuf.c mem.c mempool.c page.c pci.c utimer.c syscall.c timer.c vm.c dpdk.c worker.c networker.c dispatcher.c taskqueue.c context.c context_fast.S
+SRC = ethdev.c ethfg.c ethqueue.c cfg.c control_plane.c cpu.c init.c log.c mbuf.c mem.c mempool.c page.c pci.c utimer.c syscall.c timer.c vm.c dpdk.c worker.c networker.c dispatcher.c policy.c taskqueue.c context.c context_fast.S handler.c
 
 ifneq ($(ENABLE_KSTATS),)
 SRC += kstats.c tailqueue.c
@@ -23,149 +23,1194 @@
 /*
  * dispatcher.c - dispatcher core functionality
  *
- * A single core is responsible for receiving network packets from the network
- * core and dispatching these packets or contexts to the worker cores.
+ * Each dispatcher core owns a shard of the worker cores. It receives network
+ * packets from the network core and dispatches these packets or contexts to
+ * the workers of its shard.
  */
 
 #include <stdio.h>
+#include <emmintrin.h>
 #include <ix/cfg.h>
+#include <ix/timer.h>
+#include <ix/policy.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/transmit.h>
+#include <ix/networker.h>
 
 extern void dune_apic_send_posted_ipi(uint8_t vector, uint32_t dest_core);
 
 #define PREEMPT_VECTOR 0xf2
-#define PREEMPTION_DELAY 5000
 
-static void timestamp_init(int num_workers)
+#define STATS_INTERVAL (5 * ONE_SECOND)
+
+/* contexts held back for their last worker per dispatch */
+#define AFFINITY_MAX_HELD       4
+
+/* adaptive quantum tuning */
+#define QUANTUM_RETUNE_SAMPLES  4096
+#define QUANTUM_LIGHT_TAIL      8       /* max p99 / p50 of a light tail */
+#define QUANTUM_MAX_SCALE       16      /* max quantum / configured quantum */
+
+static void timestamp_init(struct dispatcher_shard * ds)
 {
         int i;
-        for (i = 0; i < num_workers; i++)
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_workers; i++)
                 timestamps[i] = MAX_UINT64;
 }
 
-static void preempt_check_init(int num_workers)
+static void preempt_state_init(struct dispatcher_shard * ds)
 {
         int i;
-        for (i = 0; i < num_workers; i++)
-                preempt_check[i] = false;
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_workers; i++)
+                preempt_state[i] = PREEMPT_IDLE;
 }
 
-static inline void handle_finished(int i)
+/*
+ * Workers mark all of their response slots PROCESSED, slot 0 last, once they
+ * are ready; nothing may be posted to a worker before that.
+ */
+static void handoff_init(struct dispatcher_shard * ds)
 {
-        if (worker_responses[i].mbuf == NULL)
-                log_warn("No mbuf was returned from worker\n");
-        context_free(worker_responses[i].rnbl);
-        mbuf_enqueue(&mqueue, (struct mbuf *) worker_responses[i].mbuf);
-        preempt_check[i] = false;
-        worker_responses[i].flag = PROCESSED;
+        int i;
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_workers; i++) {
+                while (worker_responses[i][0].flag != PROCESSED);
+                handoffs[i].posted = 0;
+                handoffs[i].completed = 0;
+        }
+}
+
+/*
+ * The first workers of the shard are reserved for the types that have a
+ * reservation, in type order; the others run any type.
+ */
+static void partition_init(struct dispatcher_shard * ds)
+{
+        int type, n, w = ds->first_worker;
+        int last = ds->first_worker + ds->num_workers;
+
+        for (type = 0; type < CFG_MAX_PORTS; type++) {
+                for (n = 0; n < CFG.reserve[type] && w < last; n++, w++)
+                        worker_types[w] = 1U << type;
+                if (CFG.reserve[type] || CFG.type_caps[type])
+                        ds->partitioned = true;
+        }
+        for (; w < last; w++)
+                worker_types[w] = TYPES_ALL;
+}
+
+static void shard_init(struct dispatcher_shard * ds, int shard_id)
+{
+        int i, workers = num_workers();
+
+        ds->id = shard_id;
+        ds->first_worker = shard_id * workers / CFG.num_dispatchers;
+        ds->num_workers = (shard_id + 1) * workers / CFG.num_dispatchers -
+                          ds->first_worker;
+        for (i = 0; i < CFG_MAX_PORTS; i++)
+                ds->quantum[i] = CFG.quanta[i];
+        partition_init(ds);
+
+        /* workers reserved for a type are never parked */
+        ds->num_active = ds->num_workers;
+        ds->min_active = CFG.min_workers;
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_workers; i++)
+                if (worker_types[i] != TYPES_ALL &&
+                    i - ds->first_worker >= ds->min_active)
+                        ds->min_active = i - ds->first_worker + 1;
+        if (ds->min_active > ds->num_workers)
+                ds->min_active = ds->num_workers;
+}
+
+static inline void partition_hold(struct dispatcher_shard * ds, uint8_t type)
+{
+        if (++ds->running[type] == CFG.type_caps[type])
+                ds->capped |= 1U << type;
+}
+
+static inline void partition_release(struct dispatcher_shard * ds, uint8_t type)
+{
+        if (ds->running[type]-- == CFG.type_caps[type])
+                ds->capped &= ~(1U << type);
+}
+
+static uint64_t service_percentile(uint32_t * hist, uint32_t samples,
+                                   int percent)
+{
+        int i;
+        uint64_t seen = 0, target = (uint64_t) samples * percent / 100;
+
+        for (i = 0; i < SERVICE_HIST_BUCKETS - 1; i++) {
+                seen += hist[i];
+                if (seen > target)
+                        break;
+        }
+        /* upper bound of the bucket */
+        return 1UL << i;
+}
+
+/**
+ * quantum_retune - recomputes the quantum of a type from its histogram
+ *
+ * A light-tailed type gets a quantum of twice its 99th percentile (bounded by
+ * QUANTUM_MAX_SCALE times the configured one), so that almost none of its
+ * requests pay for a preemption. A heavy-tailed type keeps the configured
+ * quantum so that its long requests do not delay everyone else. The
+ * histogram is then halved so that it follows changes in the workload.
+ */
+static void quantum_retune(struct dispatcher_shard * ds, uint8_t type)
+{
+        int i;
+        uint64_t p50, p99, q, base = CFG.quanta[type];
+        uint32_t * hist = ds->service_hist[type];
+
+        p50 = service_percentile(hist, ds->service_samples[type], 50);
+        p99 = service_percentile(hist, ds->service_samples[type], 99);
+
+        if (p99 <= QUANTUM_LIGHT_TAIL * p50) {
+                q = 2 * p99;
+                if (q < base)
+                        q = base;
+                if (q > QUANTUM_MAX_SCALE * base)
+                        q = QUANTUM_MAX_SCALE * base;
+        } else
+                q = base;
+        ds->quantum[type] = q;
+
+        for (i = 0; i < SERVICE_HIST_BUCKETS; i++)
+                hist[i] >>= 1;
+        ds->service_samples[type] >>= 1;
+}
+
+static inline void quantum_record(struct dispatcher_shard * ds, uint8_t type,
+                                  uint64_t service)
+{
+        int bucket = service ? 64 - __builtin_clzl(service) : 0;
+
+        if (bucket >= SERVICE_HIST_BUCKETS)
+                bucket = SERVICE_HIST_BUCKETS - 1;
+        ds->service_hist[type][bucket]++;
+        if (++ds->service_samples[type] >= QUANTUM_RETUNE_SAMPLES)
+                quantum_retune(ds, type);
+}
+
+/**
+ * reply_refused - answers a request that will not be served
+ * @ds: the shard
+ * @pkt: the request packet
+ * @status: RESPONSE_REJECTED or RESPONSE_TIMED_OUT
+ *
+ * Replies with a response whose runNs is @status so that the client does not
+ * wait for a timeout, and returns the packet to the networker. Replies are
+ * flushed once per dispatcher loop.
+ */
+static void reply_refused(struct dispatcher_shard * ds, struct mbuf * pkt,
+                          uint64_t status)
+{
+#ifndef FAKE_WORK
+        void * data;
+        struct ip_tuple * id;
+        struct response * resp = NULL;
+
+        parse_packet(pkt, &data, &id);
+        if (data)
+                resp = mempool_alloc(&percpu_get(response_pool));
+        if (resp) {
+                struct ip_tuple new_id = {
+                        .src_ip = id->dst_ip,
+                        .dst_ip = id->src_ip,
+                        .src_port = id->dst_port,
+                        .dst_port = id->src_port
+                };
+                resp->genNs = ((struct request *) data)->genNs;
+                resp->runNs = status;
+                if (udp_send((void *) resp, sizeof(struct response), &new_id,
+                             (uint64_t) resp))
+                        mempool_free(&percpu_get(response_pool), resp);
+                else
+                        ds->unsent_replies++;
+        }
+#endif
+        mbuf_enqueue(&ds->mqueue, pkt);
 }
 
-static inline void handle_preempted(int i)
+static inline void reject_request(struct dispatcher_shard * ds,
+                                  struct mbuf * pkt, uint8_t type)
 {
-        void * rnbl, * mbuf;
-        uint8_t type, category;
-        uint64_t timestamp;
+        ds->rejected[type]++;
+        reply_refused(ds, pkt, RESPONSE_REJECTED);
+}
 
-        rnbl = worker_responses[i].rnbl;
-        mbuf = worker_responses[i].mbuf;
-        category = worker_responses[i].category;
-        type = worker_responses[i].type;
-        timestamp = worker_responses[i].timestamp;
-        tskq_enqueue_tail(&tskq[type], rnbl, mbuf, type, category, timestamp);
-        preempt_check[i] = false;
-        worker_responses[i].flag = PROCESSED;
+/**
+ * task_expire - drops a task whose deadline has passed
+ * @ds: the shard
+ * @tsk: the task, no longer queued
+ */
+static void task_expire(struct dispatcher_shard * ds, struct task * tsk)
+{
+        if (tsk->category == CONTEXT)
+                ds->expired_preempted++;
+        else
+                ds->expired_queued++;
+        if (tsk->runnable)
+                context_free(tsk->runnable);
+        reply_refused(ds, (struct mbuf *) tsk->mbuf, RESPONSE_TIMED_OUT);
+}
+
+/**
+ * shard_enqueue - appends a task to the queue of its feedback level
+ * @ds: the shard
+ * @tsk: the task, copied into the queue
+ * @cur_time: the current time
+ *
+ * Level 0 is made of the per type queues. Returns 0 on success, -1 if the
+ * queue cannot grow.
+ */
+static inline int shard_enqueue(struct dispatcher_shard * ds, struct task * tsk,
+                                uint64_t cur_time)
+{
+        if (!tsk->level)
+                return tskq_enqueue_tail(&ds->tskq[tsk->type], tsk);
+        tsk->enqueued = cur_time;
+        return tskq_enqueue_tail(&ds->mlfq[tsk->level - 1], tsk);
 }
 
-static inline void dispatch_request(int i, uint64_t cur_time)
+static inline int shard_dequeue_mask(struct dispatcher_shard * ds,
+                                     uint32_t types, struct task * tsk,
+                                     uint64_t cur_time)
 {
-        void * rnbl, * mbuf;
-        uint8_t type, category;
-        uint64_t timestamp;
-        int ret = smart_tskq_dequeue(tskq, &rnbl, &mbuf, &type,
-                              &category, &timestamp, cur_time);
-        if(ret){
-                // printf("%d\n", ret);
+        int level;
+        struct task * oldest;
+
+        if (!policy_dequeue_mask(ds->tskq, types, tsk, cur_time))
+                return 0;
+        for (level = 1; level < CFG.mlfq_levels; level++) {
+                oldest = tskq_peek(&ds->mlfq[level - 1]);
+                if (oldest && (types & (1U << oldest->type)))
+                        return tskq_dequeue(&ds->mlfq[level - 1], tsk);
+        }
+        return -1;
+}
+
+/**
+ * shard_dequeue - removes the next task to run on a worker from a shard
+ * @ds: the shard
+ * @i: the worker
+ * @tsk: where to copy the task
+ * @cur_time: the current time
+ *
+ * The policy picks among the per type queues of level 0; lower levels are
+ * only served, in FIFO order, when all levels above them are empty. With
+ * partitioning, only the types the worker is reserved for and that are not
+ * at their cap are considered, unless the worker may borrow. Returns 0 on
+ * success, -1 if the shard has no task for the worker.
+ */
+static inline int shard_dequeue(struct dispatcher_shard * ds, int i,
+                                struct task * tsk, uint64_t cur_time)
+{
+        if (!ds->partitioned)
+                return shard_dequeue_mask(ds, TYPES_ALL, tsk, cur_time);
+
+        if (!shard_dequeue_mask(ds, worker_types[i] & ~ds->capped, tsk,
+                                cur_time))
+                return 0;
+        if (!CFG.borrow || worker_types[i] == TYPES_ALL)
+                return -1;
+        if (shard_dequeue_mask(ds, ~ds->capped, tsk, cur_time))
+                return -1;
+        ds->borrowed++;
+        return 0;
+}
+
+/**
+ * shard_requeue_head - puts a task back at the front of its queue
+ * @ds: the shard
+ * @tsk: the task, copied into the queue
+ *
+ * Used for tasks that were dequeued but could not be run after all, so that
+ * they keep their place. Returns 0 on success, -1 if the queue cannot grow.
+ */
+static inline int shard_requeue_head(struct dispatcher_shard * ds,
+                                     struct task * tsk)
+{
+        if (tsk->level)
+                return tskq_enqueue_head(&ds->mlfq[tsk->level - 1], tsk);
+        return tskq_enqueue_head(&ds->tskq[tsk->type], tsk);
+}
+
+/**
+ * affinity_dequeue - removes the next task to run on a worker
+ * @ds: the shard
+ * @i: the worker
+ * @tsk: where to copy the task
+ * @cur_time: the current time
+ *
+ * A context held back for @i comes first. A preempted context that last ran
+ * on another worker is held back for that worker, for up to
+ * CFG.affinity_window, and the next task is tried instead. Returns 0 on
+ * success, -1 if there is nothing to run.
+ */
+static int affinity_dequeue(struct dispatcher_shard * ds, int i,
+                            struct task * tsk, uint64_t cur_time)
+{
+        int tries, last;
+
+        if (affinity[i].expires) {
+                *tsk = affinity[i].task;
+                affinity[i].expires = 0;
+                return 0;
+        }
+        for (tries = 0; tries < AFFINITY_MAX_HELD; tries++) {
+                if (shard_dequeue(ds, i, tsk, cur_time))
+                        return -1;
+                last = tsk->last_worker;
+                if (tsk->category != CONTEXT || last < 0 || last == i ||
+                    affinity[last].expires)
+                        return 0;
+                affinity[last].task = *tsk;
+                affinity[last].expires = cur_time + CFG.affinity_window;
+        }
+        return shard_dequeue(ds, i, tsk, cur_time);
+}
+
+/**
+ * affinity_expire - gives up on a held back context if its worker is late
+ * @ds: the shard
+ * @i: the worker the context is held back for
+ * @cur_time: the current time
+ */
+static inline void affinity_expire(struct dispatcher_shard * ds, int i,
+                                   uint64_t cur_time)
+{
+        if (!affinity[i].expires || cur_time < affinity[i].expires)
+                return;
+        affinity[i].expires = 0;
+        if (unlikely(shard_requeue_head(ds, &affinity[i].task))) {
+                log_warn("Cannot requeue held back context\n");
+                context_free(affinity[i].task.runnable);
+                mbuf_enqueue(&ds->mqueue, (struct mbuf *) affinity[i].task.mbuf);
+                ds->load--;
+        }
+}
+
+static inline uint64_t task_quantum(struct dispatcher_shard * ds,
+                                    struct task * tsk)
+{
+        if (tsk->level)
+                return CFG.mlfq_quanta[tsk->level];
+        return ds->quantum[tsk->type];
+}
+
+/**
+ * mlfq_age - promotes tasks that waited too long in a lower level
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * Looks at the oldest task of every level below 0 and moves it one level up
+ * once it has waited CFG.mlfq_aging, so that long requests cannot starve.
+ */
+static void mlfq_age(struct dispatcher_shard * ds, uint64_t cur_time)
+{
+        int level;
+        struct task tsk;
+        struct task * oldest;
+
+        for (level = 1; level < CFG.mlfq_levels; level++) {
+                oldest = tskq_peek(&ds->mlfq[level - 1]);
+                if (!oldest || cur_time - oldest->enqueued < CFG.mlfq_aging)
+                        continue;
+                tskq_dequeue(&ds->mlfq[level - 1], &tsk);
+                tsk.level--;
+                if (unlikely(shard_enqueue(ds, &tsk, cur_time))) {
+                        log_warn("Cannot promote context\n");
+                        context_free(tsk.runnable);
+                        mbuf_enqueue(&ds->mqueue, (struct mbuf *) tsk.mbuf);
+                        ds->load--;
+                }
+        }
+}
+
+/**
+ * handoff_start - starts the preemption clock of a worker's oldest request
+ * @ds: the shard owning the worker
+ * @i: the worker
+ * @cur_time: the current time
+ *
+ * A staged request starts running as soon as the worker is done with the one
+ * before it; the dispatcher only notices that when it consumes the previous
+ * response, so the quantum is measured from then.
+ */
+static inline void handoff_start(struct dispatcher_shard * ds, int i,
+                                 uint64_t cur_time)
+{
+        struct handoff * h = &handoffs[i];
+
+        if (h->completed == h->posted) {
+                /* idle since, for parking */
+                timestamps[i] = cur_time;
+                preempt_state[i] = PREEMPT_IDLE;
                 return;
         }
-        worker_responses[i].flag = RUNNING;
-        dispatcher_requests[i].rnbl = rnbl;
-        dispatcher_requests[i].mbuf = mbuf;
-        dispatcher_requests[i].type = type;
-        dispatcher_requests[i].category = category;
-        dispatcher_requests[i].timestamp = timestamp;
         timestamps[i] = cur_time;
-        preempt_check[i] = true;
-        dispatcher_requests[i].flag = ACTIVE;
+        if (h->inflight[handoff_slot(h->completed)].batch) {
+                preempt_state[i] = PREEMPT_BATCH;
+                return;
+        }
+        quantum[i] = task_quantum(ds, &h->inflight[handoff_slot(h->completed)]);
+        preempt_state[i] = PREEMPT_RUNNING;
+}
+
+static inline void handle_finished(struct dispatcher_shard * ds, int i,
+                                   uint64_t cur_time)
+{
+        struct handoff * h = &handoffs[i];
+        unsigned int slot = handoff_slot(h->completed);
+        volatile struct worker_response * resp = &worker_responses[i][slot];
+        uint64_t service = h->inflight[slot].attained + cur_time - timestamps[i];
+        int k;
+
+        /* a batch completes as a whole; account its average per request */
+        service /= h->inflight[slot].batch + 1;
+        for (k = 0; k < h->inflight[slot].batch; k++)
+                mbuf_enqueue(&ds->mqueue,
+                             (struct mbuf *) request_batches[i][slot].mbufs[k]);
+        for (k = 0; k <= h->inflight[slot].batch; k++) {
+                policy_completed(resp->type, service);
+                if (CFG.adaptive_quantum)
+                        quantum_record(ds, resp->type, service);
+        }
+        if (resp->mbuf == NULL)
+                log_warn("No mbuf was returned from worker\n");
+        if (resp->rnbl)
+                context_free(resp->rnbl);
+        mbuf_enqueue(&ds->mqueue, (struct mbuf *) resp->mbuf);
+        resp->flag = PROCESSED;
+}
+
+static inline void handle_preempted(struct dispatcher_shard * ds, int i,
+                                    uint64_t cur_time)
+{
+        struct task tsk;
+        struct handoff * h = &handoffs[i];
+        unsigned int slot = handoff_slot(h->completed);
+        volatile struct worker_response * resp = &worker_responses[i][slot];
+
+        tsk.runnable = resp->rnbl;
+        tsk.mbuf = resp->mbuf;
+        tsk.category = resp->category;
+        tsk.type = resp->type;
+        tsk.timestamp = resp->timestamp;
+        tsk.attained = h->inflight[slot].attained + cur_time - timestamps[i];
+        tsk.level = h->inflight[slot].level;
+        tsk.last_worker = i;
+        tsk.batch = 0;
+        tsk.deadline = h->inflight[slot].deadline;
+        if (tsk.level + 1 < CFG.mlfq_levels)
+                tsk.level++;
+        if (unlikely(cur_time > tsk.deadline))
+                task_expire(ds, &tsk);
+        else if (unlikely(shard_enqueue(ds, &tsk, cur_time))) {
+                log_warn("Cannot requeue preempted context\n");
+                context_free(tsk.runnable);
+                mbuf_enqueue(&ds->mqueue, (struct mbuf *) tsk.mbuf);
+        } else
+                ds->load++;
+        resp->flag = PROCESSED;
+}
+
+/**
+ * batch_fill - batches packets of the same type behind a task
+ * @ds: the shard
+ * @i: the worker the task goes to
+ * @slot: its handoff slot
+ * @tsk: the task
+ * @cur_time: the current time
+ *
+ * Only fresh packets of types whose expected service time is below
+ * CFG.batch_threshold are batched, straight from the head of their level 0
+ * queue; their contexts are not needed since the batch runs in the one of
+ * @tsk. The packets are of the type @tsk was picked for, so the policy only
+ * orders types, not the packets within one. A batch occupies one worker
+ * like a single request, so it stays within the type's cap. A borrowed
+ * worker gets no batch, because a batch cannot be preempted to reclaim it.
+ * Returns the number of packets batched.
+ */
+static unsigned int batch_fill(struct dispatcher_shard * ds, int i,
+                               unsigned int slot, struct task * tsk,
+                               uint64_t cur_time)
+{
+        struct task_queue * tq = &ds->tskq[tsk->type];
+        struct request_batch * b = &request_batches[i][slot];
+        struct task next, * head;
+        unsigned int n = 0;
+
+        if (tsk->category != PACKET || !service_estimate[tsk->type] ||
+            service_estimate[tsk->type] >= CFG.batch_threshold)
+                return 0;
+        if (ds->partitioned && !(worker_types[i] & (1U << tsk->type)))
+                return 0;
+        while (n < CFG.batch_size - 1) {
+                head = tskq_peek(tq);
+                if (!head || head->category != PACKET)
+                        break;
+                tskq_dequeue(tq, &next);
+                ds->load--;
+                if (unlikely(cur_time > next.deadline)) {
+                        task_expire(ds, &next);
+                        continue;
+                }
+                b->mbufs[n++] = next.mbuf;
+        }
+        if (n) {
+                ds->batches++;
+                ds->batched += n;
+        }
+        return n;
+}
+
+static inline int dispatch_request(struct dispatcher_shard * ds, int i,
+                                   uint64_t cur_time)
+{
+        struct task tsk;
+        struct handoff * h = &handoffs[i];
+        unsigned int slot = handoff_slot(h->posted);
+        int ret;
+
+        while (true) {
+                if (CFG.affinity_window)
+                        ret = affinity_dequeue(ds, i, &tsk, cur_time);
+                else
+                        ret = shard_dequeue(ds, i, &tsk, cur_time);
+                if (ret)
+                        return ret;
+                ds->load--;
+                if (likely(cur_time <= tsk.deadline))
+                        break;
+                task_expire(ds, &tsk);
+        }
+        if (tsk.category == CONTEXT) {
+                if (tsk.last_worker == i)
+                        ds->affinity_hits++;
+                else
+                        ds->affinity_misses++;
+        }
+        tsk.batch = 0;
+        if (CFG.batch_size > 1)
+                tsk.batch = batch_fill(ds, i, slot, &tsk, cur_time);
+        worker_responses[i][slot].flag = RUNNING;
+        dispatcher_requests[i][slot].rnbl = tsk.runnable;
+        dispatcher_requests[i][slot].mbuf = tsk.mbuf;
+        dispatcher_requests[i][slot].type = tsk.type;
+        dispatcher_requests[i][slot].category = tsk.category;
+        dispatcher_requests[i][slot].timestamp = tsk.timestamp;
+        dispatcher_requests[i][slot].quantum = task_quantum(ds, &tsk);
+        dispatcher_requests[i][slot].batch = tsk.batch;
+        h->inflight[slot] = tsk;
+        if (ds->partitioned)
+                partition_hold(ds, tsk.type);
+        if (h->posted++ == h->completed)
+                handoff_start(ds, i, cur_time);
+        dispatcher_requests[i][slot].flag = ACTIVE;
+        return 0;
+}
+
+/**
+ * preempt_send - asks a worker to preempt its oldest request
+ * @ds: the shard owning the worker
+ * @i: the worker
+ * @cur_time: the current time
+ *
+ * The IPI is tagged with the request's sequence number, so that a handler
+ * that only runs after the request completed can tell it is late.
+ */
+static inline void preempt_send(struct dispatcher_shard * ds, int i,
+                                uint64_t cur_time)
+{
+        if (preempt_state[i] == PREEMPT_SENT)
+                ds->ipi_resends++;
+        else
+                ds->ipis_sent++;
+        preempt_mailboxes[i].target = handoffs[i].completed + 1;
+        preempt_state[i] = PREEMPT_SENT;
+        ipi_sent[i] = cur_time;
+        dune_apic_send_posted_ipi(PREEMPT_VECTOR, worker_cpu(i));
+}
+
+/**
+ * preempt_acked - checks whether a worker handled the last preemption IPI
+ * @ds: the shard owning the worker
+ * @i: the worker
+ *
+ * Returns true, and accounts the send to handler latency, if it did.
+ */
+static inline bool preempt_acked(struct dispatcher_shard * ds, int i)
+{
+        volatile struct preempt_mailbox * mb = &preempt_mailboxes[i];
+
+        if (mb->acked != mb->target)
+                return false;
+        preempt_state[i] = PREEMPT_ACKED;
+        ds->ipis_acked++;
+        ds->ipi_latency += mb->handled - ipi_sent[i];
+        return true;
+}
+
+/*
+ * A worker gets one IPI per quantum expiry rather than one per dispatcher
+ * loop; it is sent again only if it is not acknowledged within
+ * CFG.preempt_resend.
+ */
+static inline void preempt_worker(struct dispatcher_shard * ds, int i,
+                                  uint64_t cur_time)
+{
+        switch (preempt_state[i]) {
+        case PREEMPT_RUNNING:
+                if (cur_time - timestamps[i] > quantum[i])
+                        preempt_send(ds, i, cur_time);
+                break;
+        case PREEMPT_SENT:
+                if (!preempt_acked(ds, i) && CFG.preempt_resend &&
+                    cur_time - ipi_sent[i] > CFG.preempt_resend)
+                        preempt_send(ds, i, cur_time);
+                break;
+        }
+}
+
+/**
+ * partition_reclaim - frees a reserved worker for a newly arrived task
+ * @ds: the shard
+ * @type: the type of the task
+ * @cur_time: the current time
+ *
+ * If every worker reserved for @type is busy and one of them is running a
+ * borrowed request, that request is preempted.
+ */
+static void partition_reclaim(struct dispatcher_shard * ds, uint8_t type,
+                              uint64_t cur_time)
+{
+        int i, victim = -1;
+        struct handoff * h;
+
+        if (!CFG.reserve[type] || CFG.preempt_mode == PREEMPT_MODE_COOPERATIVE)
+                return;
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_active; i++) {
+                if (worker_types[i] != 1U << type)
+                        continue;
+                h = &handoffs[i];
+                if (h->posted == h->completed)
+                        return;
+                if (victim < 0 && preempt_state[i] == PREEMPT_RUNNING &&
+                    h->inflight[handoff_slot(h->completed)].type != type)
+                        victim = i;
+        }
+        if (victim < 0)
+                return;
+        ds->reclaims++;
+        preempt_send(ds, victim, cur_time);
+}
+
+/**
+ * status_scan - finds the workers of a shard that posted new responses
+ * @ds: the shard
+ * @last: one past the last worker to scan
+ * @ready: bitmap of workers, set for those with new responses
+ *
+ * Compares 16 status bytes at a time with the ones seen last, and records
+ * the current ones as seen. A worker bumps its status after writing its
+ * response, so a response is visible once its status change is.
+ */
+static inline void status_scan(struct dispatcher_shard * ds, int last,
+                               uint64_t * ready)
+{
+        int base, i;
+        uint32_t bits;
+        __m128i cur, seen;
+
+        for (i = 0; i < MAX_WORKERS / 64; i++)
+                ready[i] = 0;
+        for (base = ds->first_worker & ~15; base < last; base += 16) {
+                cur = _mm_load_si128((const __m128i *) &worker_status[base]);
+                seen = _mm_load_si128((const __m128i *) &ds->status_seen[base]);
+                bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(cur, seen)) & 0xFFFF;
+                if (!bits)
+                        continue;
+                _mm_store_si128((__m128i *) &ds->status_seen[base], cur);
+                ready[base / 64] |= (uint64_t) bits << (base % 64);
+        }
 }
 
-static inline void preempt_worker(int i, uint64_t cur_time)
+static inline void handle_worker(struct dispatcher_shard * ds, int i,
+                                 bool ready, uint64_t cur_time)
 {
-        if (preempt_check[i] && (((cur_time - timestamps[i]) / 2.5) > PREEMPTION_DELAY)) {
-                // Avoid preempting more times.
-                // preempt_check[i] = false;
-                dune_apic_send_posted_ipi(PREEMPT_VECTOR, CFG.cpu[i + 2]);
+        struct handoff * h = &handoffs[i];
+        volatile struct worker_response * resp;
+
+        /* responses come back in the order the requests were posted */
+        while (ready && h->completed != h->posted) {
+                resp = &worker_responses[i][handoff_slot(h->completed)];
+                if (resp->flag == RUNNING)
+                        break;
+                if (ds->partitioned)
+                        partition_release(ds,
+                                h->inflight[handoff_slot(h->completed)].type);
+                if (resp->flag == FINISHED)
+                        handle_finished(ds, i, cur_time);
+                else if (resp->flag == PREEMPTED)
+                        handle_preempted(ds, i, cur_time);
+                if (preempt_state[i] == PREEMPT_SENT)
+                        preempt_acked(ds, i);
+                h->completed++;
+                handoff_start(ds, i, cur_time);
         }
+
+        if (CFG.affinity_window)
+                affinity_expire(ds, i, cur_time);
+
+        while (h->posted - h->completed < CFG.handoff_depth)
+                if (dispatch_request(ds, i, cur_time))
+                        break;
+
+        if (CFG.preempt_mode == PREEMPT_MODE_IPI)
+                preempt_worker(ds, i, cur_time);
 }
 
-static inline void handle_worker(int i, uint64_t cur_time)
+/**
+ * handoff_pull_back - revokes a staged request in favour of a queued one
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * Finds the staged request, among those that wait behind a running one, that
+ * the policy ranks lowest. If the best queued task outranks it and the worker
+ * has not claimed it yet, it goes back to the front of its queue and its slot
+ * is refilled by the policy.
+ */
+static void handoff_pull_back(struct dispatcher_shard * ds, uint64_t cur_time)
 {
-        if (worker_responses[i].flag != RUNNING) {
-                if (worker_responses[i].flag == FINISHED) {
-                        handle_finished(i);
-                } else if (worker_responses[i].flag == PREEMPTED) {
-                        handle_preempted(i);
+        int i, idx, victim = -1;
+        unsigned int slot;
+        uint64_t best, rank, lowest = MAX_UINT64;
+        struct handoff * h;
+        struct task tsk;
+
+        idx = policy_select(ds->tskq, cur_time);
+        if (idx < 0)
+                return;
+        best = sched_policy->rank(tskq_peek(&ds->tskq[idx]), cur_time);
+
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_active; i++) {
+                h = &handoffs[i];
+                if (h->posted - h->completed < 2 ||
+                    h->inflight[handoff_slot(h->posted - 1)].batch)
+                        continue;
+                rank = sched_policy->rank(&h->inflight[handoff_slot(h->posted - 1)],
+                                          cur_time);
+                if (rank < lowest) {
+                        lowest = rank;
+                        victim = i;
                 }
-                dispatch_request(i, cur_time);
+        }
+        if (victim < 0 || lowest >= best)
+                return;
+
+        h = &handoffs[victim];
+        slot = handoff_slot(h->posted - 1);
+        if (!__sync_bool_compare_and_swap(&dispatcher_requests[victim][slot].flag,
+                                          ACTIVE, WAITING))
+                return;         /* already claimed by the worker */
+
+        h->posted--;
+        worker_responses[victim][slot].flag = PROCESSED;
+        tsk = h->inflight[slot];
+        if (ds->partitioned)
+                partition_release(ds, tsk.type);
+        if (unlikely(shard_requeue_head(ds, &tsk))) {
+                log_warn("Cannot requeue staged request\n");
+                if (tsk.runnable)
+                        context_free(tsk.runnable);
+                mbuf_enqueue(&ds->mqueue, (struct mbuf *) tsk.mbuf);
         } else
-                preempt_worker(i, cur_time);
-}
-
-static inline void handle_networker(uint64_t cur_time)
-{
-        int i, ret;
-        uint8_t type;
-        ucontext_t * cont;
-        if (networker_pointers.cnt != 0) {
-                for (i = 0; i < networker_pointers.cnt; i++) {
-                        ret = context_alloc(&cont);
-                        if (unlikely(ret)) {
-                                log_warn("Cannot allocate context\n");
-                                mbuf_enqueue(&mqueue, (struct mbuf *) networker_pointers.pkts[i]);
-                                continue;
-                        }
-                        type = networker_pointers.types[i];
-                        tskq_enqueue_tail(&tskq[type], cont,
-                                          (void *)networker_pointers.pkts[i],
-                                          type, PACKET, cur_time);
+                ds->load++;
+        dispatch_request(ds, victim, cur_time);
+}
+
+static inline int64_t remaining_service(struct task * tsk, uint64_t attained)
+{
+        int64_t remaining = service_estimate[tsk->type] - attained;
+        return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * task_slack - returns how long a task can still be delayed
+ * @tsk: the task
+ * @attained: the service it has received so far
+ * @cur_time: the current time
+ *
+ * The slack is the time left until the task's SLO expires minus its expected
+ * remaining service time; it is negative if the task is already expected to
+ * miss its SLO. Tasks of types without an SLO have unlimited slack.
+ */
+static inline int64_t task_slack(struct task * tsk, uint64_t attained,
+                                 uint64_t cur_time)
+{
+        if (tsk->type >= CFG.num_slos)
+                return INT64_MAX;
+        return (int64_t) (tsk->timestamp + CFG.slos[tsk->type] - cur_time) -
+               remaining_service(tsk, attained);
+}
+
+/**
+ * urgent_preempt - makes room for a new task that cannot wait
+ * @ds: the shard
+ * @tsk: the newly queued task
+ * @cur_time: the current time
+ *
+ * If every worker is busy and the first of them to become free is expected
+ * to do so only after @tsk runs out of slack, the running request with the
+ * most slack is preempted right away, provided it has more slack than @tsk.
+ * Queued tasks are not taken into account: the policy lets urgent tasks
+ * jump ahead of them anyway.
+ */
+static void urgent_preempt(struct dispatcher_shard * ds, struct task * tsk,
+                           uint64_t cur_time)
+{
+        int i, victim = -1;
+        int64_t need, slack, remaining, wait = INT64_MAX, max = INT64_MIN;
+        uint64_t attained;
+        struct handoff * h;
+        struct task * running;
+
+        need = task_slack(tsk, 0, cur_time);
+        if (need == INT64_MAX)
+                return;
+
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_active; i++) {
+                h = &handoffs[i];
+                if (preempt_state[i] == PREEMPT_BATCH)
+                        continue;
+                /* idle, or already being preempted */
+                if (preempt_state[i] != PREEMPT_RUNNING)
+                        return;
+                /* preempting it would only start its staged request */
+                if (h->posted - h->completed > 1)
+                        continue;
+                running = &h->inflight[handoff_slot(h->completed)];
+                attained = running->attained + cur_time - timestamps[i];
+                remaining = remaining_service(running, attained);
+                if (remaining < wait)
+                        wait = remaining;
+                slack = task_slack(running, attained, cur_time);
+                if (slack > max) {
+                        max = slack;
+                        victim = i;
                 }
+        }
+        if (victim < 0 || wait <= need || max <= need)
+                return;
+
+        ds->urgent_preemptions++;
+        preempt_send(ds, victim, cur_time);
+}
+
+/**
+ * admission_backlog - estimates the work queued in a shard
+ * @ds: the shard
+ *
+ * Returns the sum of the expected service times of the queued tasks, in
+ * cycles. Service already attained by preempted tasks is not subtracted, so
+ * the estimate errs on the side of rejecting.
+ */
+static uint64_t admission_backlog(struct dispatcher_shard * ds)
+{
+        int i;
+        uint64_t backlog = 0;
+
+        for (i = 0; i < CFG.num_ports; i++)
+                backlog += tskq_len(&ds->tskq[i]) * service_estimate[i];
+        return backlog;
+}
+
+/**
+ * admission_check - decides whether a new request can still meet its SLO
+ * @ds: the shard
+ * @type: the request type
+ * @backlog: the queued work of the shard, in cycles
+ *
+ * The predicted sojourn time is the backlog spread over the active workers
+ * of the shard plus the expected service time of the request. Types without an SLO
+ * or without a service estimate yet are always admitted.
+ */
+static inline bool admission_check(struct dispatcher_shard * ds, uint8_t type,
+                                   uint64_t backlog)
+{
+        uint64_t sojourn;
+
+        if (type >= CFG.num_slos || !service_estimate[type])
+                return true;
+        sojourn = backlog / ds->num_active + service_estimate[type];
+        return sojourn * 100 <= CFG.slos[type] * CFG.admission_factor;
+}
+
+/**
+ * shard_admit - queues a received packet as a new task
+ * @ds: the shard
+ * @pkt: the packet
+ * @type: its request type
+ * @backlog: the shard's backlog for admission control, updated
+ * @cur_time: the current time
+ */
+static inline void shard_admit(struct dispatcher_shard * ds, struct mbuf * pkt,
+                               uint8_t type, uint64_t * backlog,
+                               uint64_t cur_time)
+{
+        uint64_t rx_time;
+        struct task tsk;
+
+        if (CFG.admission_factor && !admission_check(ds, type, *backlog)) {
+                reject_request(ds, pkt, type);
+                return;
+        }
+        tsk.runnable = NULL;
+        tsk.mbuf = (void *)pkt;
+        tsk.type = type;
+        tsk.category = PACKET;
+        tsk.timestamp = cur_time;
+        tsk.attained = 0;
+        tsk.level = 0;
+        tsk.last_worker = -1;
+        tsk.batch = 0;
+        rx_time = pkt->timestamp;
+        if (!rx_time)
+                rx_time = cur_time;
+        tsk.deadline = MAX_UINT64;
+        if (CFG.budgets[tsk.type])
+                tsk.deadline = rx_time + CFG.budgets[tsk.type];
+        if (unlikely(tskq_enqueue_tail(&ds->tskq[tsk.type], &tsk))) {
+                log_warn("Cannot enqueue task\n");
+                reject_request(ds, pkt, type);
+                return;
+        }
+        ds->load++;
+        *backlog += service_estimate[tsk.type];
+        if (CFG.urgent_preemption)
+                urgent_preempt(ds, &tsk, cur_time);
+        if (ds->partitioned)
+                partition_reclaim(ds, tsk.type, cur_time);
+}
+
+static inline void handle_networker(struct dispatcher_shard * ds,
+                                    uint64_t cur_time)
+{
+        int i;
+        uint64_t backlog = 0;
+        volatile struct networker_pointers_t * np;
+
+        np = &networker_pointers[ds->id];
+        if (np->cnt != 0) {
+                ds->received += np->cnt;
+                if (CFG.admission_factor)
+                        backlog = admission_backlog(ds);
+                for (i = 0; i < np->cnt; i++)
+                        shard_admit(ds, np->pkts[i], np->types[i], &backlog,
+                                    cur_time);
+
+                if (CFG.handoff_depth > 1)
+                        handoff_pull_back(ds, cur_time);
 
                 for (i = 0; i < ETH_RX_MAX_BATCH; i++) { 
-                        struct mbuf * buf = mbuf_dequeue(&mqueue);
+                        struct mbuf * buf = mbuf_dequeue(&ds->mqueue);
                         if (!buf)
                                 break;
-                        networker_pointers.pkts[i] = buf;
-                        networker_pointers.free_cnt++;
+                        np->pkts[i] = buf;
+                        np->free_cnt++;
                 }
-                networker_pointers.cnt = 0;
+                np->cnt = 0;
         }
 }
 
 /**
- * do_dispatching - implements dispatcher core's main loop
+ * handle_rx - runs the networker loop on the dispatcher core
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * Used instead of handle_networker() with a fused networker: packets go
+ * from the NIC straight to the task queues, and finished ones are freed
+ * here rather than handed back through the networker mailbox.
  */
-void do_dispatching(int num_cpus)
+static inline void handle_rx(struct dispatcher_shard * ds, uint64_t cur_time)
+{
+        int i, cnt;
+        uint64_t backlog = 0;
+        struct mbuf * buf;
+        struct mbuf * pkts[ETH_RX_MAX_BATCH];
+        uint8_t types[ETH_RX_MAX_BATCH];
+
+        while ((buf = mbuf_dequeue(&ds->mqueue)))
+                networker_free(buf);
+
+        cnt = networker_recv(pkts, types);
+        if (!cnt)
+                return;
+        ds->received += cnt;
+        if (CFG.admission_factor)
+                backlog = admission_backlog(ds);
+        for (i = 0; i < cnt; i++)
+                shard_admit(ds, pkts[i], types[i], &backlog, cur_time);
+        if (CFG.handoff_depth > 1)
+                handoff_pull_back(ds, cur_time);
+}
+
+/**
+ * worker_park - parks the last active worker of a shard if it is surplus
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * The worker must have been idle for CFG.park_idle with nothing queued in
+ * the shard and nothing held back for it.
+ */
+static inline void worker_park(struct dispatcher_shard * ds, uint64_t cur_time)
+{
+        int i = ds->first_worker + ds->num_active - 1;
+        struct handoff * h = &handoffs[i];
+
+        if (ds->num_active <= ds->min_active || ds->load)
+                return;
+        if (h->posted != h->completed || affinity[i].expires ||
+            cur_time - timestamps[i] < CFG.park_idle)
+                return;
+        park_mailboxes[i].parked = 1;
+        ds->num_active--;
+        ds->parks++;
+}
+
+/**
+ * worker_unpark - wakes a parked worker when tasks queue up
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * Only one worker is woken per call, and only if no active worker is idle.
+ */
+static inline void worker_unpark(struct dispatcher_shard * ds,
+                                 uint64_t cur_time)
+{
+        int i, last = ds->first_worker + ds->num_active;
+
+        if (ds->num_active == ds->num_workers || !ds->load)
+                return;
+        for (i = ds->first_worker; i < last; i++)
+                if (handoffs[i].posted == handoffs[i].completed)
+                        return;
+        timestamps[last] = cur_time;
+        park_mailboxes[last].parked = 0;
+        ds->num_active++;
+        ds->unparks++;
+}
+
+#ifdef ENABLE_KSTATS
+/**
+ * shard_stats_report - logs the scheduling counters of a shard
+ * @ds: the shard
+ * @cur_time: the current time
+ *
+ * Throughput is reported over the interval since the previous report, so
+ * that runs with and without fused_networker can be compared.
+ */
+static void shard_stats_report(struct dispatcher_shard * ds,
+                               uint64_t cur_time)
 {
         int i;
+        uint64_t rejected = 0, late = 0, completed = ds->batched, elapsed;
+
+        for (i = 0; i < CFG.num_ports; i++)
+                rejected += ds->rejected[i];
+        for (i = ds->first_worker; i < ds->first_worker + ds->num_workers; i++) {
+                late += preempt_mailboxes[i].late;
+                completed += handoffs[i].completed;
+        }
+        elapsed = cycles_to_ns(cur_time - ds->report_time);
+        if (ds->report_time && elapsed)
+                log_info("dispatcher %d: %s networker received %lu/s "
+                         "completed %lu/s\n", ds->id,
+                         CFG.fused_networker ? "fused" : "split",
+                         (ds->received - ds->report_received) * ONE_SECOND *
+                         1000 / elapsed,
+                         (completed - ds->report_completed) * ONE_SECOND *
+                         1000 / elapsed);
+        ds->report_received = ds->received;
+        ds->report_completed = completed;
+        ds->report_time = cur_time;
+        log_info("dispatcher %d: load %lu rejected %lu urgent preemptions %lu "
+                 "affinity hits %lu misses %lu\n", ds->id, ds->load, rejected,
+                 ds->urgent_preemptions, ds->affinity_hits,
+                 ds->affinity_misses);
+        log_info("dispatcher %d: expired before running %lu after preemption "
+                 "%lu\n", ds->id, ds->expired_queued, ds->expired_preempted);
+        log_info("dispatcher %d: ipis sent %lu resent %lu acked %lu late %lu "
+                 "avg latency %lu ns\n", ds->id, ds->ipis_sent,
+                 ds->ipi_resends, ds->ipis_acked, late,
+                 ds->ipis_acked ?
+                 cycles_to_ns(ds->ipi_latency / ds->ipis_acked) : 0);
+        if (ds->batches)
+                log_info("dispatcher %d: batches %lu avg size %lu\n", ds->id,
+                         ds->batches,
+                         (ds->batches + ds->batched) / ds->batches);
+        if (CFG.park_idle)
+                log_info("dispatcher %d: active workers %d parked %lu woken "
+                         "%lu\n", ds->id, ds->num_active, ds->parks,
+                         ds->unparks);
+        if (ds->partitioned)
+                log_info("dispatcher %d: borrowed %lu reclaimed %lu\n",
+                         ds->id, ds->borrowed, ds->reclaims);
+}
+#endif
+
+/**
+ * do_dispatching - implements dispatcher core's main loop
+ * @shard_id: the shard of workers owned by this dispatcher
+ */
+void do_dispatching(int shard_id)
+{
+        int i, last;
         uint64_t cur_time;
+        uint64_t ready[MAX_WORKERS / 64];
+        struct dispatcher_shard * ds = &shards[shard_id];
+#ifdef ENABLE_KSTATS
+        uint64_t next_report = 0;
+#endif
 
-        preempt_check_init(num_cpus - 2);
-        timestamp_init(num_cpus - 2);
+        shard_init(ds, shard_id);
+        preempt_state_init(ds);
+        timestamp_init(ds);
+        handoff_init(ds);
+        log_info("dispatcher %d: serving workers %d-%d\n", shard_id,
+                 ds->first_worker, ds->first_worker + ds->num_workers - 1);
 
         while(1) {
                 cur_time = rdtsc();
-                for (i = 0; i < num_cpus - 2; i++)
-                        handle_worker(i, cur_time);
-                handle_networker(cur_time);
+                if (CFG.mlfq_levels > 1 && CFG.mlfq_aging)
+                        mlfq_age(ds, cur_time);
+                last = ds->first_worker + ds->num_active;
+                status_scan(ds, last, ready);
+                for (i = ds->first_worker; i < last; i++)
+                        handle_worker(ds, i, (ready[i / 64] >> (i % 64)) & 1,
+                                      cur_time);
+                if (CFG.fused_networker)
+                        handle_rx(ds, cur_time);
+                else
+                        handle_networker(ds, cur_time);
+                if (CFG.park_idle) {
+                        worker_unpark(ds, cur_time);
+                        worker_park(ds, cur_time);
+                }
+                if (ds->unsent_replies) {
+                        eth_process_reclaim();
+                        eth_process_send();
+                        ds->unsent_replies = 0;
+                }
+#ifdef ENABLE_KSTATS
+                if (cur_time >= next_report) {
+                        shard_stats_report(ds, cur_time);
+                        next_report = cur_time + STATS_INTERVAL * cycles_per_us;
+                }
+#endif
         }
 }
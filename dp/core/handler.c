@@ -0,0 +1,182 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * handler.c - application request handlers
+ */
+
+#include <dlfcn.h>
+
+#include <ix/cfg.h>
+#include <ix/errno.h>
+#include <ix/handler.h>
+#include <ix/log.h>
+#include <ix/mempool.h>
+#include <ix/transmit.h>
+
+#define RFLAGS_IF       (1UL << 9)
+
+request_handler_t handlers[CFG_MAX_PORTS];
+
+/* defined by handlers linked into the binary, if any */
+extern int shinjuku_handlers_init(void) __attribute__((weak));
+
+/*
+ * Handlers may run with interrupts enabled, and a preemption between
+ * looking up a per cpu pool and using it would leave the request on another
+ * core, using this one's pool.
+ */
+static inline unsigned long irq_save(void)
+{
+        unsigned long flags;
+
+        asm volatile ("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+        return flags;
+}
+
+static inline void irq_restore(unsigned long flags)
+{
+        if (flags & RFLAGS_IF)
+                asm volatile ("sti" : : : "memory");
+}
+
+/**
+ * handler_register - sets the handler of a request type
+ * @type: the request type
+ * @fn: the handler
+ *
+ * Only valid during initialization, before the workers start.
+ *
+ * Returns 0 on success, -EINVAL if @type has no port.
+ */
+int handler_register(uint8_t type, request_handler_t fn)
+{
+        if (type >= CFG.num_ports || !fn) {
+                log_err("handler: no port for request type %d\n", type);
+                return -EINVAL;
+        }
+        handlers[type] = fn;
+        return 0;
+}
+
+/**
+ * reply_buf - gets the buffer to build a response in
+ * @rep: the reply
+ *
+ * The buffer holds REPLY_MAX_LEN bytes and stays the same until it is sent.
+ *
+ * Returns the buffer, or NULL if none is available.
+ */
+void * reply_buf(struct reply * rep)
+{
+        unsigned long flags;
+
+        if (rep->buf)
+                return rep->buf;
+        flags = irq_save();
+        rep->buf = mempool_alloc(&percpu_get(response_pool));
+        irq_restore(flags);
+        if (unlikely(!rep->buf))
+                log_warn("Cannot allocate response buffer\n");
+        return rep->buf;
+}
+
+/**
+ * reply_send - sends the response built in the reply buffer
+ * @rep: the reply
+ * @len: the length of the response
+ *
+ * The buffer is freed once transmitted, or right away if the send fails; a
+ * further response needs a new reply_buf().
+ *
+ * Returns 0 on success, otherwise fail.
+ */
+int reply_send(struct reply * rep, size_t len)
+{
+        int ret;
+        unsigned long flags;
+        struct ip_tuple new_id = {
+                .src_ip = rep->id->dst_ip,
+                .dst_ip = rep->id->src_ip,
+                .src_port = rep->id->dst_port,
+                .dst_port = rep->id->src_port
+        };
+
+        if (!rep->buf || len > REPLY_MAX_LEN)
+                return -EINVAL;
+
+        flags = irq_save();
+        ret = udp_send(rep->buf, len, &new_id, (uint64_t) rep->buf);
+        if (ret)
+                mempool_free(&percpu_get(response_pool), rep->buf);
+        irq_restore(flags);
+        if (ret)
+                log_warn("udp_send failed with error %d\n", ret);
+        rep->buf = NULL;
+        return ret;
+}
+
+/**
+ * reply_discard - frees a reply buffer that was not sent
+ * @rep: the reply
+ */
+void reply_discard(struct reply * rep)
+{
+        unsigned long flags;
+
+        if (!rep->buf)
+                return;
+        flags = irq_save();
+        mempool_free(&percpu_get(response_pool), rep->buf);
+        irq_restore(flags);
+        rep->buf = NULL;
+}
+
+/**
+ * handler_init - registers the linked in handlers or loads the library
+ *
+ * Request types left without a handler keep the default one set up by the
+ * worker code.
+ */
+int handler_init(void)
+{
+        void * lib;
+        int (*init)(void);
+
+        if (!CFG.handler_path[0])
+                return shinjuku_handlers_init ? shinjuku_handlers_init() : 0;
+
+        lib = dlopen(CFG.handler_path, RTLD_NOW | RTLD_GLOBAL);
+        if (!lib) {
+                log_err("handler: cannot load '%s': %s\n", CFG.handler_path,
+                        dlerror());
+                return -EINVAL;
+        }
+        init = (int (*)(void)) dlsym(lib, HANDLER_INIT_SYMBOL);
+        if (!init) {
+                log_err("handler: '%s' has no %s\n", CFG.handler_path,
+                        HANDLER_INIT_SYMBOL);
+                return -EINVAL;
+        }
+        return init();
+}
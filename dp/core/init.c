@@ -85,16 +85,17 @@ extern int mempool_init(void);
 extern int init_migration_cpu(void);
 extern int dpdk_init(void);
 extern int taskqueue_init(void);
+extern int taskqueue_init_cpu(void);
 extern int response_init(void);
+extern int work_init(void);
+extern int handler_init(void);
 extern int response_init_cpu(void);
 extern int context_init(void);
+extern int context_init_cpu(void);
 extern void do_work(void);
 extern void do_networking(void);
 extern void do_work_gen(void);
-extern void do_dispatching(int num_cpus);
-
-extern struct mempool context_pool;
-extern struct mempool stack_pool;
+extern void do_dispatching(int shard_id);
 
 struct init_vector_t {
 	const char *name;
@@ -109,13 +110,15 @@ static struct init_vector_t init_tbl[] = {
 	{ "Dune",    init_dune,    NULL, NULL},
 	{ "timer",   timer_init,   timer_init_cpu, NULL},
 	{ "net",     net_init,     NULL, NULL},
-	{ "cfg",     init_cfg,     NULL, NULL},              // after net
+	{ "cfg",     init_cfg,     NULL, NULL},              // after net, timer
 	{ "dpdk",    dpdk_init,    NULL, NULL},
 	{ "firstcpu", init_firstcpu, NULL, NULL},             // after cfg
 	{ "mbuf",    mbuf_init,    mbuf_init_cpu, NULL},      // after firstcpu
-	{ "taskqueue", taskqueue_init, NULL, NULL},      // after firstcpu
+	{ "taskqueue", taskqueue_init, taskqueue_init_cpu, NULL},      // after firstcpu
 	{ "response", response_init, response_init_cpu, NULL},
-	{ "context", context_init, NULL},
+	{ "work",    work_init,    NULL, NULL},               // after timer
+	{ "handler", handler_init, NULL, NULL},               // after work
+	{ "context", context_init, context_init_cpu, NULL},
         { "ethdev", init_ethdev, NULL, NULL},
         { "tx_queue", NULL, init_tx_queues, NULL},
 	{ "hw",      init_hw,      NULL, NULL},               // spaws per-cpu init sequence
@@ -258,7 +261,8 @@ static int init_network_cpu(void)
 		}
         }
 
-        networker_pointers.cnt = 0;
+        for (i = 0; i < CFG.num_dispatchers; i++)
+                networker_pointers[i].cnt = 0;
 
 	return 0;
 }
@@ -318,7 +322,7 @@ void *start_cpu(void *arg)
 	percpu_get(cpu_nr) = cpu_nr_;
 
 	log_info("start_cpu: starting cpu-specific work\n");
-	if (cpu_nr_ == 1) {
+	if (cpu_nr_ == 1 && !CFG.fused_networker) {
 		ret = init_rx_queue();
 		if (ret) {
 						log_err("init: failed to initialize RX queue\n");
@@ -339,6 +343,10 @@ void *start_cpu(void *arg)
 		pthread_barrier_wait(&start_barrier);
 		// do_networking();
 		do_work_gen();
+	} else if (cpu_nr_ < worker_cpu_offset()) {
+		started_cpus++;
+		pthread_barrier_wait(&start_barrier);
+		do_dispatching(cpu_nr_ - 1);
 	} else {
 		started_cpus++;
 		pthread_barrier_wait(&start_barrier);
@@ -362,6 +370,15 @@ static int init_hw(void)
 
 	percpu_get(cpu_nr) = 0;
 
+	/* with a fused networker, CPU 0 takes over the networker's setup */
+	if (CFG.fused_networker) {
+		ret = init_rx_queue();
+		if (ret) {
+			log_err("init: failed to initialize RX queue\n");
+			return ret;
+		}
+	}
+
 	for (i = 1; i < CFG.num_cpus; i++) {
 		ret = pthread_create(&tid, NULL, start_cpu, (void *)(unsigned long) i);
 		if (ret) {
@@ -372,6 +389,14 @@ static int init_hw(void)
 			usleep(100);
 	}
 
+	if (CFG.fused_networker) {
+		ret = init_network_cpu();
+		if (ret) {
+			log_err("init: failed to initialize network cpu\n");
+			return ret;
+		}
+	}
+
 	if (CFG.num_cpus > 1) {
 		pthread_barrier_wait(&start_barrier);
 	}
@@ -434,7 +459,7 @@ int main(int argc, char *argv[])
   
 	log_info("init done\n");
 
-  do_dispatching(CFG.num_cpus);
+  do_dispatching(0);
 	log_info("finished handling contexts, looping forever...\n");
 	return 0;
 }
@@ -24,7 +24,9 @@
  * networker.c - networking core functionality
  *
  * A single core is responsible for receiving all network packets in the
- * system and forwading them to the dispatcher.
+ * system and forwading them to the dispatchers. Each batch goes to the least
+ * loaded dispatcher shard whose mailbox is free, which keeps the shards'
+ * queues balanced.
  */
 #include <stdio.h>
 
@@ -35,6 +37,7 @@
 #include <ix/dispatch.h>
 #include <ix/ethqueue.h>
 #include <ix/transmit.h>
+#include <ix/networker.h>
 
 #include <asm/chksum.h>
 
@@ -42,27 +45,57 @@
 #include <net/udp.h>
 #include <net/ethernet.h>
 
+/**
+ * pick_shard - selects the dispatcher shard for the next batch
+ *
+ * Spins until at least one shard has consumed its previous batch and returns
+ * the one with the fewest queued tasks among those.
+ */
+static int pick_shard(void)
+{
+        int i, best;
+        uint64_t load, min;
+
+        while (true) {
+                best = -1;
+                min = MAX_UINT64;
+                for (i = 0; i < CFG.num_dispatchers; i++) {
+                        if (networker_pointers[i].cnt != 0)
+                                continue;
+                        load = shards[i].load;
+                        if (load < min) {
+                                min = load;
+                                best = i;
+                        }
+                }
+                if (best != -1)
+                        return best;
+                cpu_relax();
+        }
+}
+
 /**
  * do_networking - implements networking core's functionality
  */
 void do_networking(void)
 {
         int i, num_recv;
+        volatile struct networker_pointers_t * np;
         while(1) {
                 eth_process_poll();
                 num_recv = eth_process_recv();
                 if (num_recv == 0)
                         continue;
-                while (networker_pointers.cnt != 0);
-                for (i = 0; i < networker_pointers.free_cnt; i++) {
-                        mbuf_free(networker_pointers.pkts[i]);
+                np = &networker_pointers[pick_shard()];
+                for (i = 0; i < np->free_cnt; i++) {
+                        mbuf_free(np->pkts[i]);
                 }
-                networker_pointers.free_cnt = 0;
+                np->free_cnt = 0;
                 for (i = 0; i < num_recv; i++) {
-                        networker_pointers.pkts[i] = recv_mbufs[i];
-                        networker_pointers.types[i] = (uint8_t) recv_type[i];
+                        np->pkts[i] = recv_mbufs[i];
+                        np->types[i] = (uint8_t) recv_type[i];
                 }
-                networker_pointers.cnt = num_recv;
+                np->cnt = num_recv;
         }
 }
 
@@ -90,20 +123,67 @@ volatile struct mbuf* gen_fake_reqs(void) {
 
 void do_work_gen(void) {
         int i;
+        volatile struct networker_pointers_t * np;
         while(1) {
-                while(networker_pointers.cnt !=0);
-                for (i = 0; i < networker_pointers.free_cnt; i++) {
-                        live_reqs[i] = 0;
+                np = &networker_pointers[pick_shard()];
+                for (i = 0; i < np->free_cnt; i++) {
+                        live_reqs[np->pkts[i] - fake_pkts] = 0;
                 }       
-                networker_pointers.free_cnt = 0;
+                np->free_cnt = 0;
                 for (i = 0; i < ETH_RX_MAX_BATCH; i++) {
                         struct mbuf* temp = gen_fake_reqs();
                         if(!temp) {
                                 break; // no more packets to receive
                         }
-                        networker_pointers.pkts[i] = temp;
-                        networker_pointers.types[i] = 0; // For now, only 1 port/type    
+                        temp->timestamp = rdtsc();
+                        np->pkts[i] = temp;
+                        np->types[i] = 0; // For now, only 1 port/type    
                 }
-                networker_pointers.cnt = i;
+                np->cnt = i;
         }
-}
\ No newline at end of file
+}
+
+/**
+ * networker_recv - receives a batch of packets on the calling core
+ * @pkts: where to store the packets, ETH_RX_MAX_BATCH entries
+ * @types: where to store their types
+ *
+ * Used by a dispatcher that runs the networker loop itself. Returns the
+ * number of packets received.
+ */
+int networker_recv(struct mbuf ** pkts, uint8_t * types)
+{
+        int i, num_recv;
+#ifdef FAKE_WORK
+        for (i = 0; i < ETH_RX_MAX_BATCH; i++) {
+                struct mbuf * temp = (struct mbuf *) gen_fake_reqs();
+                if (!temp)
+                        break;
+                temp->timestamp = rdtsc();
+                pkts[i] = temp;
+                types[i] = 0;
+        }
+        num_recv = i;
+#else
+        eth_process_poll();
+        num_recv = eth_process_recv();
+        for (i = 0; i < num_recv; i++) {
+                pkts[i] = recv_mbufs[i];
+                types[i] = (uint8_t) recv_type[i];
+        }
+#endif
+        return num_recv;
+}
+
+/**
+ * networker_free - releases a packet received by networker_recv()
+ * @pkt: the packet
+ */
+void networker_free(struct mbuf * pkt)
+{
+#ifdef FAKE_WORK
+        live_reqs[pkt - (struct mbuf *) fake_pkts] = 0;
+#else
+        mbuf_free(pkt);
+#endif
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * policy.c - built-in dispatcher scheduling policies
+ *
+ * fcfs: oldest request first, regardless of type.
+ * slo:  largest waiting time to SLO ratio first (the default).
+ * edf:  earliest deadline (arrival + SLO) first, types without an SLO last.
+ * srpt: shortest expected remaining service time first, based on per type
+ *       service times learned online.
+ */
+
+#include <string.h>
+
+#include <ix/cfg.h>
+#include <ix/policy.h>
+#include <ix/dispatch.h>
+
+uint64_t service_estimate[CFG_MAX_PORTS];
+
+static uint64_t fcfs_rank(struct task * tsk, uint64_t cur_time)
+{
+        return MAX_UINT64 - tsk->timestamp;
+}
+
+/* waiting time * SLO_RECIP_SCALE / slo, without dividing */
+static uint64_t slo_ratio_rank(struct task * tsk, uint64_t cur_time)
+{
+        uint64_t diff = cur_time - tsk->timestamp;
+        return ((unsigned __int128) diff * CFG.slo_recip[tsk->type]) >> 32;
+}
+
+/* types without an SLO have no deadline and rank last, as with slo */
+static uint64_t edf_rank(struct task * tsk, uint64_t cur_time)
+{
+        if (!CFG.slos[tsk->type])
+                return 0;
+        return MAX_UINT64 - (tsk->timestamp + CFG.slos[tsk->type]);
+}
+
+static uint64_t srpt_rank(struct task * tsk, uint64_t cur_time)
+{
+        uint64_t est = service_estimate[tsk->type];
+        uint64_t remaining = est > tsk->attained ? est - tsk->attained : 0;
+        return MAX_UINT64 - remaining;
+}
+
+static const struct sched_policy policies[] = {
+        { "fcfs",       fcfs_rank},
+        { "slo",        slo_ratio_rank},
+        { "edf",        edf_rank},
+        { "srpt",       srpt_rank},
+        { NULL,         NULL}
+};
+
+const struct sched_policy * sched_policy = &policies[1];
+
+/**
+ * policy_find - looks up a built-in policy by name
+ * @name: the policy name
+ *
+ * Returns the policy, or NULL if there is no policy with that name.
+ */
+const struct sched_policy * policy_find(const char * name)
+{
+        int i;
+
+        for (i = 0; policies[i].name; i++) {
+                if (!strcmp(policies[i].name, name))
+                        return &policies[i];
+        }
+        return NULL;
+}
@@ -24,7 +24,11 @@
  * taskqueue.c - taskqueue management
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <ix/mem.h>
+#include <ix/cpu.h>
+#include <ix/log.h>
 #include <ix/stddef.h>
 #include <ix/mempool.h>
 #include <ix/dispatch.h>
@@ -32,20 +36,87 @@
 #define TASK_CAPACITY    (768*1024)
 #define MCELL_CAPACITY   (768*1024)
 
-static int task_init_mempool(void)
+DEFINE_PERCPU(struct mempool, task_mempool __attribute__((aligned(64))));
+DEFINE_PERCPU(struct mempool, mcell_mempool __attribute__((aligned(64))));
+
+#ifdef ENABLE_KSTATS
+#define BENCH_OPS	(1 << 20)
+
+static volatile uint64_t bench_sink;
+
+/*
+ * Logs the cost of an enqueue/dequeue pair on the dispatcher's task rings,
+ * with bursts of @burst tasks spread round-robin over @nr_types queues.
+ * Bursts longer than TASKQ_SIZE per queue go through the overflow list.
+ */
+static void taskqueue_bench_types(struct task_queue *tqs, int nr_types,
+				  int burst)
 {
-	struct mempool *m = &task_mempool;
-	return mempool_create(m, &task_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	int i, j;
+	uint64_t start;
+	struct task tsk = {0};
+
+	for (i = 0; i < nr_types; i++)
+		memset(&tqs[i], 0, offsetof(struct task_queue, ring));
+	start = rdtsc();
+	for (i = 0; i < BENCH_OPS / burst; i++) {
+		for (j = 0; j < burst; j++) {
+			tsk.timestamp = j;
+			tskq_enqueue_tail(&tqs[j % nr_types], &tsk);
+		}
+		for (j = 0; j < burst; j++) {
+			tskq_dequeue(&tqs[j % nr_types], &tsk);
+			bench_sink = tsk.timestamp;
+		}
+	}
+	log_info("taskqueue: %lu cycles per enqueue/dequeue with %d types, "
+		 "bursts of %d\n", (rdtsc() - start) / BENCH_OPS, nr_types,
+		 burst);
 }
 
-static int mcell_init_mempool(void)
+static void taskqueue_bench(void)
 {
-	struct mempool *m = &mcell_mempool;
-	return mempool_create(m, &mcell_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	struct task_queue *tqs;
+
+	tqs = aligned_alloc(64, 16 * sizeof(struct task_queue));
+	if (!tqs)
+		return;
+	taskqueue_bench_types(tqs, 1, 512);
+	taskqueue_bench_types(tqs, 4, 512);
+	taskqueue_bench_types(tqs, 16, 512);
+	/* half of every burst spills over */
+	taskqueue_bench_types(tqs, 1, 2 * TASKQ_SIZE);
+	free(tqs);
 }
+#endif
 
 /**
- * taskqueue_init - allocate global task mempool
+ * taskqueue_init_cpu - creates the per cpu task overflow and mcell mempools
+ *
+ * Every dispatcher shard allocates from its own mempools, so shards never
+ * contend on anything but the (locked) datastores.
+ */
+int taskqueue_init_cpu(void)
+{
+	int ret;
+
+	ret = mempool_create(&percpu_get(task_mempool), &task_datastore,
+			     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+	if (ret)
+		return ret;
+
+	ret = mempool_create(&percpu_get(mcell_mempool), &mcell_datastore,
+			     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+#ifdef ENABLE_KSTATS
+	/* the overflow list needs the per cpu task mempool */
+	if (!ret && percpu_get(cpu_nr) == 0)
+		taskqueue_bench();
+#endif
+	return ret;
+}
+
+/**
+ * taskqueue_init - allocate global task overflow and mcell datastores
  *
  * Returns 0 if successful, otherwise failure.
  */
@@ -55,26 +126,17 @@ int taskqueue_init(void)
 	struct mempool_datastore *t = &task_datastore;
 	struct mempool_datastore *m = &mcell_datastore;
 
-	ret = mempool_create_datastore(t, TASK_CAPACITY, sizeof(struct task),
+	ret = mempool_create_datastore(t, TASK_CAPACITY, sizeof(struct task_cell),
                                        1, MEMPOOL_DEFAULT_CHUNKSIZE, "task");
 	if (ret) {
 		return ret;
 	}
 
-        ret = task_init_mempool();
-        if (ret) {
-                return ret;
-        }
-
 	ret = mempool_create_datastore(m, MCELL_CAPACITY, sizeof(struct mbuf_cell),
                                        1, MEMPOOL_DEFAULT_CHUNKSIZE, "mcell");
 	if (ret) {
 		return ret;
 	}
 
-        ret = mcell_init_mempool();
-        if (ret) {
-                return ret;
-        }
         return 0;
 }
@@ -23,12 +23,12 @@
 /*
  * worker.c - Worker core functionality
  *
- * Poll dispatcher CPU to get request to execute. The request is in the form
- * of ucontext_t. If interrupted, swap to main context and poll for next
- * request.
+ * Poll dispatcher CPU to get request to execute. A new request runs in the
+ * worker's scratch context for its stack class; a preempted one comes back
+ * as the struct context it was preempted in. If interrupted, swap to main
+ * context and poll for next request.
  */
 
-#include <ucontext.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,10 +42,14 @@
 #include <ix/cpu.h>
 #include <ix/log.h>
 #include <ix/mbuf.h>
+#include <ix/timer.h>
 #include <asm/cpu.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/handler.h>
+#include <ix/networker.h>
 #include <ix/transmit.h>
+#include <ix/yield.h>
 
 #include <dune.h>
 
@@ -55,37 +59,95 @@
 
 #define PREEMPT_VECTOR 0xf2
 
-__thread ucontext_t uctx_main;
-__thread ucontext_t * cont;
+#define SPIN_CALIBRATION_ITERS  (1 << 22)
+#define SPIN_YIELD_STRIDE       64
+
+__thread struct context uctx_main;
+__thread struct context * cont;
+/* per stack class: the context new requests run in until one is preempted */
+__thread struct context * scratch[CFG_MAX_PORTS];
 __thread int cpu_nr_;
 __thread volatile uint8_t finished;
+__thread unsigned int slot;     /* handoff slot of the current request */
+__thread uint64_t req_seq;      /* requests served so far */
+__thread uint64_t deadline;     /* TSC deadline of the preemption timer */
+__thread uint64_t yield_deadline = MAX_UINT64;
+__thread int use_mwait;
 
-DEFINE_PERCPU(struct mempool, response_pool __attribute__((aligned(64))));
+/* iterations of the synthetic work loop per microsecond */
+static uint64_t spin_iters_per_us;
 
-extern int getcontext_fast(ucontext_t *ucp);
-extern int swapcontext_fast(ucontext_t *ouctx, ucontext_t *uctx);
-extern int swapcontext_very_fast(ucontext_t *ouctx, ucontext_t *uctx);
+DEFINE_PERCPU(struct mempool, response_pool __attribute__((aligned(64))));
 
 extern void dune_apic_eoi();
 extern int dune_register_intr_handler(int vector, dune_intr_cb cb);
 
-struct response {
-        uint64_t runNs;
-        uint64_t genNs;
-};
+static inline void spin(uint64_t iters)
+{
+        uint64_t i = 0;
+        do {
+                asm volatile ("nop");
+                i++;
+                YIELD_CHECK_EVERY(i, SPIN_YIELD_STRIDE);
+        } while (i < iters);
+}
+
+/**
+ * spin_handler - the default handler, a synthetic spin loop
+ * @req: the request, giving the time to spin for
+ * @rep: the reply
+ *
+ * Spins for a number of loop iterations rather than until a TSC deadline,
+ * so that time spent preempted does not count as work.
+ */
+static void spin_handler(const struct request_view * req, struct reply * rep)
+{
+        const struct request * r = req->data;
+        struct response * resp;
+
+        spin(r->runNs * spin_iters_per_us / 1000);
 
-struct request {
-        uint64_t runNs;
-        uint64_t genNs;
-};
+        resp = reply_buf(rep);
+        if (!resp)
+                return;
+        resp->genNs = r->genNs;
+        resp->runNs = r->runNs;
+        reply_send(rep, sizeof(struct response));
+}
+
+/**
+ * work_init - calibrates the synthetic work loop against the TSC
+ *
+ * Also makes it the handler of every request type, until others are
+ * registered.
+ */
+int work_init(void)
+{
+        int i;
+        uint64_t start, cycles;
+
+        for (i = 0; i < CFG_MAX_PORTS; i++)
+                handlers[i] = spin_handler;
+
+        start = rdtsc();
+        spin(SPIN_CALIBRATION_ITERS);
+        cycles = rdtsc() - start;
+        if (!cycles)
+                return -1;
+
+        spin_iters_per_us = SPIN_CALIBRATION_ITERS * cycles_per_us / cycles;
+        log_info("work: %lu iterations per us\n", spin_iters_per_us);
+        return 0;
+}
 
 /**
  * response_init - allocates global response datastore
  */
 int response_init(void)
 {
+        BUILD_ASSERT(sizeof(struct response) <= REPLY_MAX_LEN);
         return mempool_create_datastore(&response_datastore, 128000,
-                                        sizeof(struct response), 1,
+                                        REPLY_MAX_LEN, 1,
                                         MEMPOOL_DEFAULT_CHUNKSIZE,
                                         "response");
 }
@@ -100,121 +162,240 @@ int response_init_cpu(void)
                               percpu_get(cpu_id));
 }
 
+/*
+ * Only preempt the request the IPI was sent for: an IPI that was pending
+ * while interrupts were disabled may be delivered after that request has
+ * completed, while a later one runs. The preemption timer shares the vector
+ * and is recognized by its deadline having passed.
+ */
 static void test_handler(struct dune_tf *tf)
 {
+        volatile struct preempt_mailbox * mb = &preempt_mailboxes[cpu_nr_];
+        uint64_t target = mb->target;
+
         asm volatile ("cli":::);
         dune_apic_eoi();
+        if (target == req_seq + 1) {
+                mb->handled = rdtsc();
+                mb->acked = target;
+        } else if (!deadline || rdtsc() < deadline) {
+                mb->late++;
+                return;
+        }
+        context_save_xstate(cont);
         swapcontext_fast_to_control(cont, &uctx_main);
 }
 
 /**
- * generic_work - generic function acting as placeholder for application-level
- *                work
- * @msw: the top 32-bits of the pointer containing the data
- * @lsw: the bottom 32 bits of the pointer containing the data
+ * quantum_start - starts the quantum of the current request
+ *
+ * Only needed when workers time their own quanta. The local APIC timer runs
+ * in TSC-deadline mode, so arming and disarming it is a single MSR write.
  */
-static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
-                         uint32_t lsw_id)
+static inline void quantum_start(void)
 {
-        asm volatile ("sti":::);
+        uint64_t q = dispatcher_requests[cpu_nr_][slot].quantum;
+
+        switch (CFG.preempt_mode) {
+        case PREEMPT_MODE_TIMER:
+                deadline = rdtsc() + q;
+                wrmsr(MSR_IA32_TSC_DEADLINE, deadline);
+                break;
+        case PREEMPT_MODE_COOPERATIVE:
+                yield_deadline = rdtsc() + q;
+                break;
+        default:
+                break;
+        }
+}
 
-        struct ip_tuple * id = (struct ip_tuple *) ((uint64_t) msw_id << 32 | lsw_id);
-        void * data = (void *)((uint64_t) msw << 32 | lsw);
-        int ret;
+static inline void quantum_stop(void)
+{
+        switch (CFG.preempt_mode) {
+        case PREEMPT_MODE_TIMER:
+                deadline = 0;
+                wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+                break;
+        case PREEMPT_MODE_COOPERATIVE:
+                yield_deadline = MAX_UINT64;
+                break;
+        default:
+                break;
+        }
+}
 
-        struct request * req = (struct request *) data;
+/**
+ * yield_now - preempts the current request from within its handler
+ *
+ * Called by yield_check() once the quantum has expired. Returns when the
+ * dispatcher resumes the request.
+ */
+void yield_now(void)
+{
+        yield_deadline = MAX_UINT64;
+        swapcontext_fast_to_control(cont, &uctx_main);
+}
 
-        uint64_t i = 0;
-        do {
-                asm volatile ("nop");
-                i++;
-        } while ( i / 0.233 < req->runNs);
+/**
+ * run_handler - runs the handler of a request and drops an unsent reply
+ * @type: the request type
+ * @data: the request payload
+ * @id: the flow the request came in on
+ */
+static inline void run_handler(uint8_t type, void * data, struct ip_tuple * id)
+{
+        struct request_view req = {
+                .data = data,
+                .len = packet_data_len(data),
+                .type = type,
+        };
+        struct reply rep = {
+                .id = id,
+                .buf = NULL,
+        };
 
-        asm volatile ("cli":::);
-        struct response * resp = mempool_alloc(&percpu_get(response_pool));
-        if (!resp) {
-                log_warn("Cannot allocate response buffer\n");
-                finished = true;
-                swapcontext_very_fast(cont, &uctx_main);
-        }
+        handlers[type](&req, &rep);
+        reply_discard(&rep);
+}
 
-        resp->genNs = req->genNs;
-        resp->runNs = req->runNs;
-        struct ip_tuple new_id = {
-                .src_ip = id->dst_ip,
-                .dst_ip = id->src_ip,
-                .src_port = id->dst_port,
-                .dst_port = id->src_port
-        };
+/**
+ * request_work - runs a request in its context
+ * @data: the request payload
+ * @id: the flow the request came in on
+ */
+static void request_work(void * data, void * id)
+{
+        uint8_t type = dispatcher_requests[cpu_nr_][slot].type;
 
-        ret = udp_send((void *)resp, sizeof(struct response), &new_id,
-                       (uint64_t) resp);
-        if (ret)
-                log_warn("udp_send failed with error %d\n", ret);
+        if (CFG.preempt_mode != PREEMPT_MODE_COOPERATIVE)
+                asm volatile ("sti":::);
 
+        run_handler(type, data, (struct ip_tuple *) id);
+
+        asm volatile ("cli":::);
         finished = true;
         swapcontext_very_fast(cont, &uctx_main);
 }
 
-static inline void parse_packet(struct mbuf * pkt, void ** data_ptr,
-                                struct ip_tuple ** id_ptr)
+/**
+ * batch_work - runs a batch of requests back to back
+ *
+ * The batch is short by construction, so it runs with interrupts disabled
+ * and is never preempted.
+ */
+static void batch_work(void * unused0, void * unused1)
 {
-        // Quickly parse packet without doing checks
-        struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
-        struct ip_hdr *  iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
-        int hdrlen = iphdr->header_len * sizeof(uint32_t);
-        struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
-                                                 hdrlen);
-        // Get data and udp header
-        (*data_ptr) = mbuf_nextd(udphdr, void *);
-        uint16_t len = ntoh16(udphdr->len);
-
-        if (unlikely(!mbuf_enough_space(pkt, udphdr, len))) {
-                log_warn("worker: not enough space in mbuf\n");
-                (*data_ptr) = NULL;
-                return;
+        volatile struct dispatcher_request * dreq;
+        struct mbuf * pkt;
+        struct ip_tuple * id;
+        void * data;
+        int k;
+
+        dreq = &dispatcher_requests[cpu_nr_][slot];
+        for (k = 0; k <= dreq->batch; k++) {
+                if (k)
+                        pkt = request_batches[cpu_nr_][slot].mbufs[k - 1];
+                else
+                        pkt = (struct mbuf *) dreq->mbuf;
+                parse_packet(pkt, &data, &id);
+                if (!data)
+                        continue;
+                run_handler(dreq->type, data, id);
         }
 
-        (*id_ptr) = mbuf_mtod(pkt, struct ip_tuple *);
-        (*id_ptr)->src_ip = ntoh32(iphdr->src_addr.addr);
-        (*id_ptr)->dst_ip = ntoh32(iphdr->dst_addr.addr);
-        (*id_ptr)->src_port = ntoh16(udphdr->src_port);
-        (*id_ptr)->dst_port = ntoh16(udphdr->dst_port);
-        pkt->done = (void *) 0xDEADBEEF;
+        finished = true;
+        swapcontext_very_fast(cont, &uctx_main);
 }
 
 static inline void init_worker(void)
 {
-        cpu_nr_ = percpu_get(cpu_nr) - 2;
-        worker_responses[cpu_nr_].flag = PROCESSED;
-        dune_register_intr_handler(PREEMPT_VECTOR, test_handler);
+        int i;
+
+        cpu_nr_ = percpu_get(cpu_nr) - worker_cpu_offset();
+        slot = 0;
+        req_seq = 0;
+        use_mwait = CFG.park_mwait && cpu_has_monitor();
+        /* slot 0 last: the dispatcher waits for it before posting */
+        for (i = CFG.handoff_depth - 1; i >= 0; i--)
+                worker_responses[cpu_nr_][i].flag = PROCESSED;
+        if (CFG.preempt_mode != PREEMPT_MODE_COOPERATIVE)
+                dune_register_intr_handler(PREEMPT_VECTOR, test_handler);
+        if (CFG.preempt_mode == PREEMPT_MODE_TIMER)
+                wrmsr(MSR_X2APIC_LVT_TIMER,
+                      APIC_LVT_TIMER_TSCDEADLINE | PREEMPT_VECTOR);
         eth_process_reclaim();
         asm volatile ("cli":::);
 }
 
+/**
+ * scratch_context - gets the scratch context to run a new request in
+ * @type: the request type
+ *
+ * Most requests finish within their quantum, so they run on a stack that
+ * stays warm in this core's cache instead of a fresh context. Only a
+ * preemption hands the scratch context over to the request, together with
+ * its stack, and the next request of the class allocates a new one. The
+ * dispatcher frees handed over contexts into its own pools, and the chunks
+ * flow back to the workers through the shared datastores.
+ *
+ * Returns the context, or NULL if none could be allocated.
+ */
+static inline struct context * scratch_context(uint8_t type)
+{
+        uint8_t class = stack_class_of[type];
+
+        if (unlikely(!scratch[class]) && context_alloc(&scratch[class], type))
+                return NULL;
+        scratch[class]->type = type;
+        return scratch[class];
+}
+
+static inline void handle_batch(void)
+{
+        int ret;
+
+        cont = scratch_context(dispatcher_requests[cpu_nr_][slot].type);
+        if (unlikely(!cont)) {
+                log_warn("Cannot allocate context\n");
+                finished = true;
+                return;
+        }
+        context_make(cont, batch_work, NULL, NULL);
+        finished = false;
+        ret = swapcontext_very_fast(&uctx_main, cont);
+        if (ret) {
+                log_err("Failed to do swap into new context\n");
+                exit(-1);
+        }
+}
+
 static inline void handle_new_packet(void)
 {
         int ret;
         void * data;
         struct ip_tuple * id;
-        struct mbuf * pkt = (struct mbuf *) dispatcher_requests[cpu_nr_].mbuf;
+        struct mbuf * pkt = (struct mbuf *) dispatcher_requests[cpu_nr_][slot].mbuf;
+
+        if (dispatcher_requests[cpu_nr_][slot].batch) {
+                handle_batch();
+                return;
+        }
         parse_packet(pkt, &data, &id);
-        if (data) {
-                uint32_t msw = ((uint64_t) data & 0xFFFFFFFF00000000) >> 32;
-                uint32_t lsw = (uint64_t) data & 0x00000000FFFFFFFF;
-                uint32_t msw_id = ((uint64_t) id & 0xFFFFFFFF00000000) >> 32;
-                uint32_t lsw_id = (uint64_t) id & 0x00000000FFFFFFFF;
-                cont = dispatcher_requests[cpu_nr_].rnbl;
-                getcontext_fast(cont);
-                set_context_link(cont, &uctx_main);
-                makecontext(cont, (void (*)(void)) generic_work, 4, msw, lsw,
-                            msw_id, lsw_id);
+        cont = NULL;
+        if (data)
+                cont = scratch_context(dispatcher_requests[cpu_nr_][slot].type);
+        if (cont) {
+                context_make(cont, request_work, data, id);
                 finished = false;
+                quantum_start();
                 ret = swapcontext_very_fast(&uctx_main, cont);
                 if (ret) {
                         log_err("Failed to do swap into new context\n");
                         exit(-1);
                 }
+        } else if (data) {
+                log_warn("Cannot allocate context\n");
+                finished = true;
         } else {
                 log_info("OOPS No Data\n");
                 finished = true;
@@ -229,11 +410,12 @@ static inline void handle_fake_new_packet(void) {
 
 static inline void handle_context(void)
 {
-        printf("Got context\n");
         int ret;
+
         finished = false;
-        cont = dispatcher_requests[cpu_nr_].rnbl;
-        set_context_link(cont, &uctx_main);
+        cont = dispatcher_requests[cpu_nr_][slot].rnbl;
+        quantum_start();
+        context_restore_xstate(cont);
         ret = swapcontext_fast(&uctx_main, cont);
         if (ret) {
                 log_err("Failed to swap to existing context\n");
@@ -241,11 +423,61 @@ static inline void handle_context(void)
         }
 }
 
+/**
+ * park - waits until the dispatcher wakes this worker up
+ *
+ * With park_mwait, uses monitor/mwait on the mailbox where available, so
+ * that the core can drop into a low power state; a write to the mailbox
+ * ends the wait even with interrupts disabled. Otherwise spins with pause,
+ * since MONITOR/MWAIT may cause VM exits that Dune does not handle.
+ */
+static void park(void)
+{
+        volatile struct park_mailbox * pm = &park_mailboxes[cpu_nr_];
+
+        while (pm->parked) {
+                if (use_mwait) {
+                        cpu_monitor(&pm->parked);
+                        if (pm->parked)
+                                cpu_mwait();
+                } else
+                        cpu_relax();
+        }
+}
+
+static inline void request_wait(volatile struct dispatcher_request * req)
+{
+        while (req->flag == WAITING)
+                if (unlikely(park_mailboxes[cpu_nr_].parked))
+                        park();
+}
+
+/**
+ * claim_request - waits for the request of the current slot and claims it
+ *
+ * With a single slot the dispatcher never revokes a posted request, so a
+ * plain store is enough. Otherwise the claim races with the dispatcher
+ * pulling the request back, and whoever flips the flag first wins.
+ */
+static inline void claim_request(void)
+{
+        volatile struct dispatcher_request * req;
+
+        req = &dispatcher_requests[cpu_nr_][slot];
+        if (CFG.handoff_depth == 1) {
+                request_wait(req);
+                req->flag = WAITING;
+                return;
+        }
+        do {
+                request_wait(req);
+        } while (!__sync_bool_compare_and_swap(&req->flag, ACTIVE, WAITING));
+}
+
 static inline void handle_request(void)
 {
-        while (dispatcher_requests[cpu_nr_].flag == WAITING);
-        dispatcher_requests[cpu_nr_].flag = WAITING;
-        if (dispatcher_requests[cpu_nr_].category == PACKET)
+        claim_request();
+        if (dispatcher_requests[cpu_nr_][slot].category == PACKET)
                 handle_new_packet();
         else
                 handle_context();
@@ -253,29 +485,45 @@ static inline void handle_request(void)
 
 static inline void handle_fake_request(void)
 {
-        while (dispatcher_requests[cpu_nr_].flag == WAITING);
-        dispatcher_requests[cpu_nr_].flag = WAITING;
-        if (dispatcher_requests[cpu_nr_].category == PACKET)
+        claim_request();
+        if (dispatcher_requests[cpu_nr_][slot].category == PACKET)
                 handle_fake_new_packet();
         else
                 handle_context();
 }
 
+/*
+ * A finished request leaves its scratch context to the next one, after a
+ * check of the stack canary that context_free() would otherwise do. A
+ * preempted request keeps the context it ran in.
+ */
 static inline void finish_request(void)
 {
-        worker_responses[cpu_nr_].timestamp = \
-                        dispatcher_requests[cpu_nr_].timestamp;
-        worker_responses[cpu_nr_].type = \
-                        dispatcher_requests[cpu_nr_].type;
-        worker_responses[cpu_nr_].mbuf = \
-                        dispatcher_requests[cpu_nr_].mbuf;
-        worker_responses[cpu_nr_].rnbl = cont;
-        worker_responses[cpu_nr_].category = CONTEXT;
+        bool in_scratch;
+
+        quantum_stop();
+        in_scratch = cont && cont == scratch[cont->stack_class];
+        if (in_scratch && finished)
+                context_check_stack(cont);
+        else if (in_scratch)
+                scratch[cont->stack_class] = NULL;
+        worker_responses[cpu_nr_][slot].timestamp = \
+                        dispatcher_requests[cpu_nr_][slot].timestamp;
+        worker_responses[cpu_nr_][slot].type = \
+                        dispatcher_requests[cpu_nr_][slot].type;
+        worker_responses[cpu_nr_][slot].mbuf = \
+                        dispatcher_requests[cpu_nr_][slot].mbuf;
+        worker_responses[cpu_nr_][slot].rnbl = in_scratch && finished ?
+                                                NULL : cont;
+        worker_responses[cpu_nr_][slot].category = CONTEXT;
         if (finished) {
-                worker_responses[cpu_nr_].flag = FINISHED;
+                worker_responses[cpu_nr_][slot].flag = FINISHED;
         } else {
-                worker_responses[cpu_nr_].flag = PREEMPTED;
+                worker_responses[cpu_nr_][slot].flag = PREEMPTED;
         }
+        worker_status[cpu_nr_]++;
+        slot = handoff_slot(slot + 1);
+        req_seq++;
 }
 
 void do_work(void)
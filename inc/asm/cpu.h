@@ -49,6 +49,10 @@
 #define CACHE_LINE_SIZE	64
 
 #define MSR_PKG_ENERGY_STATUS 0x00000611
+#define MSR_IA32_TSC_DEADLINE 0x000006e0
+#define MSR_X2APIC_LVT_TIMER  0x00000832
+
+#define APIC_LVT_TIMER_TSCDEADLINE (2 << 17)
 
 #define cpu_relax() asm volatile("pause")
 
@@ -78,3 +82,76 @@ static inline unsigned long rdmsr(unsigned int msr)
 	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
 	return low | ((unsigned long)high << 32);
 }
+
+static inline void wrmsr(unsigned int msr, unsigned long val)
+{
+	asm volatile("wrmsr" : : "c"(msr), "a"((unsigned int) val),
+		     "d"((unsigned int) (val >> 32)));
+}
+
+static inline void cpuid_count(unsigned int leaf, unsigned int subleaf,
+			       unsigned int *a, unsigned int *b,
+			       unsigned int *c, unsigned int *d)
+{
+	asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+		     : "a"(leaf), "c"(subleaf));
+}
+
+static inline void cpuid(unsigned int leaf, unsigned int *a, unsigned int *b,
+			 unsigned int *c, unsigned int *d)
+{
+	cpuid_count(leaf, 0, a, b, c, d);
+}
+
+/* XCR0 for @idx 0; the XINUSE bitmap for @idx 1, where supported */
+static inline unsigned long xgetbv(unsigned int idx)
+{
+	unsigned int a, d;
+
+	asm volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(idx));
+	return a | ((unsigned long) d << 32);
+}
+
+static inline void xsave(void *area, unsigned long mask)
+{
+	asm volatile("xsave64 (%0)" : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32)) : "memory");
+}
+
+static inline void xsaveopt(void *area, unsigned long mask)
+{
+	asm volatile("xsaveopt64 (%0)" : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32)) : "memory");
+}
+
+static inline void xsavec(void *area, unsigned long mask)
+{
+	asm volatile("xsavec64 (%0)" : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32)) : "memory");
+}
+
+static inline void xrstor(void *area, unsigned long mask)
+{
+	asm volatile("xrstor64 (%0)" : : "r"(area), "a"((unsigned int) mask),
+		     "d"((unsigned int) (mask >> 32)) : "memory");
+}
+
+static inline int cpu_has_monitor(void)
+{
+	unsigned int a, b, c, d;
+
+	cpuid(1, &a, &b, &c, &d);
+	return c & (1 << 3);
+}
+
+/* arms address monitoring on the cache line of @addr */
+static inline void cpu_monitor(const volatile void *addr)
+{
+	asm volatile("monitor" : : "a"(addr), "c"(0), "d"(0));
+}
+
+/* waits for a write to the monitored line, or an interrupt */
+static inline void cpu_mwait(void)
+{
+	asm volatile("mwait" : : "a"(0), "c"(0));
+}
@@ -34,7 +34,19 @@
 #define CFG_MAX_PORTS    16
 #define CFG_MAX_CPU     128
 #define CFG_MAX_ETHDEV   16
+#define CFG_MAX_DISPATCHERS 8
+#define CFG_MAX_HANDOFF_DEPTH 4
+#define CFG_MAX_MLFQ_LEVELS 4
+#define CFG_MAX_BATCH    8
 
+#define SLO_RECIP_SCALE  1024
+
+
+enum preempt_mode {
+	PREEMPT_MODE_IPI = 0,		/* the dispatcher sends posted IPIs */
+	PREEMPT_MODE_TIMER,		/* workers arm their local APIC timer */
+	PREEMPT_MODE_COOPERATIVE,	/* handlers call yield_check() */
+};
 
 struct cfg_ip_addr {
 	uint32_t addr;
@@ -51,16 +63,54 @@ struct cfg_parameters {
 	int num_cpus;
 	unsigned int cpu[CFG_MAX_CPU];
 
+	int num_dispatchers;
+	bool fused_networker;		/* dispatcher 0 also polls the NIC */
+	int handoff_depth;
+
+	/* per shard core partitioning by request type */
+	int reserve[CFG_MAX_PORTS];	/* workers reserved for the type */
+	int type_caps[CFG_MAX_PORTS];	/* max workers running it; 0: no cap */
+	bool borrow;			/* reserved workers may run others */
+
 	int num_ethdev;
 	struct pci_addr ethdev[CFG_MAX_ETHDEV];
 
 	int num_ports;
 	uint16_t ports[CFG_MAX_PORTS];
 
+	/* all times are in TSC cycles */
 	int num_slos;
-	float slos[CFG_MAX_PORTS];
+	uint64_t slos[CFG_MAX_PORTS];
+	uint64_t slo_recip[CFG_MAX_PORTS];	/* (SLO_RECIP_SCALE << 32) / slo */
+
+	uint64_t quanta[CFG_MAX_PORTS];
+	uint64_t budgets[CFG_MAX_PORTS];	/* deadline after rx; 0: none */
+	uint32_t stack_sizes[CFG_MAX_PORTS];	/* bytes, per request type */
+	bool adaptive_quantum;
+	bool urgent_preemption;
+	uint64_t preempt_resend;	/* 0: never re-send a preemption IPI */
+	enum preempt_mode preempt_mode;
+	uint64_t affinity_window;	/* 0: resume contexts anywhere */
+
+	/* requests of a type cheaper than batch_threshold go out in batches */
+	int batch_size;			/* 1: no batching */
+	uint64_t batch_threshold;
+
+	/* multi-level feedback queue for preempted tasks; off below 2 levels */
+	int mlfq_levels;
+	uint64_t mlfq_quanta[CFG_MAX_MLFQ_LEVELS];	/* level 0 uses quanta[] */
+	uint64_t mlfq_aging;				/* 0: never promote */
+
+	/* park surplus workers after this long idle; 0: never park */
+	uint64_t park_idle;
+	int min_workers;		/* per shard, never parked */
+	bool park_mwait;		/* park in mwait instead of pause */
+
+	/* reject when the predicted sojourn exceeds this % of the SLO; 0: off */
+	int admission_factor;
 
 	char loader_path[256];
+	char handler_path[256];		/* handler library; empty: none */
 };
 
 extern struct cfg_parameters CFG;
@@ -27,64 +27,198 @@
 #pragma once
 
 #include <stdint.h>
-#include <ucontext.h>
+#include <string.h>
 
+#include <ix/cfg.h>
+#include <ix/cpu.h>
 #include <ix/mempool.h>
 
+#define STACK_CANARY        0x57ac4ca9a2d5e11dUL
+
+#define MXCSR_DEFAULT       0x1f80
+#define FPUCW_DEFAULT       0x037f
+
+/*
+ * A context only holds what a switch through a function call must preserve:
+ * the callee-saved registers, the stack and instruction pointers and the FP
+ * control words. Registers clobbered by a call are saved by the caller, or
+ * by the interrupt entry code when a context is preempted. Field offsets
+ * are mirrored in context_fast.S.
+ */
+struct context {
+        uint64_t rbx;
+        uint64_t rbp;
+        uint64_t r12;
+        uint64_t r13;
+        uint64_t r14;
+        uint64_t r15;
+        uint64_t rsp;
+        uint64_t rip;
+        uint32_t mxcsr;
+        uint16_t fpucw;
+        uint8_t type;           /* request type, for overflow reports */
+        uint8_t stack_class;
+        void * stack;           /* base of the stack, for freeing */
+        uint64_t xsaved;        /* 0 if xarea holds no state to restore */
+        /* XSAVE area of xstate_size bytes, 64-byte aligned within */
+        uint8_t xarea[];
+};
+
+enum xstate_insn {
+        XSTATE_XSAVE = 0,
+        XSTATE_XSAVEOPT,
+        XSTATE_XSAVEC,
+};
+
+/* components saved on preemption; 0 if XSAVE is not usable */
+extern uint64_t xstate_mask;
+extern unsigned int xstate_size;
+extern enum xstate_insn xstate_insn;
+extern bool xstate_xinuse;              /* xgetbv(1) reports XINUSE */
+
 struct mempool_datastore context_datastore;
-struct mempool context_pool __attribute((aligned(64)));
-struct mempool_datastore stack_datastore;
-struct mempool stack_pool __attribute((aligned(64)));
+/*
+ * Request types with the same configured stack size share a stack class,
+ * each with its own datastore and per cpu pool.
+ */
+struct mempool_datastore stack_datastores[CFG_MAX_PORTS];
+extern unsigned int nr_stack_classes;
+extern uint8_t stack_class_of[CFG_MAX_PORTS];
+extern uint32_t stack_class_size[CFG_MAX_PORTS];
+DECLARE_PERCPU(struct mempool, context_pool);
+DECLARE_PERCPU(struct mempool, stack_pools[CFG_MAX_PORTS]);
+
+extern void context_stack_overflow(struct context *c);
 
-extern int getcontext_fast(ucontext_t *ucp);
+/* all return 0; the first context is saved, the second one resumed */
+extern int swapcontext_very_fast(struct context *ouctx, struct context *uctx);
+extern int swapcontext_fast(struct context *ouctx, struct context *uctx);
+extern int swapcontext_fast_to_control(struct context *ouctx,
+                                       struct context *uctx);
+extern void context_start(void);
+
+static inline void * context_xstate(struct context *c)
+{
+    return (void *) (((uintptr_t) c->xarea + 63) & ~63UL);
+}
 
 /**
- * context_alloc - allocates a ucontext_t and its stack
+ * context_alloc - allocates a context and a stack for a request type
  * @cont: pointer to the pointer of the allocated context
+ * @type: the request type
+ *
+ * The lowest word of the stack holds a canary, checked when it is freed.
  *
  * Returns 0 on success, -1 if failure.
  */
-static inline int context_alloc(ucontext_t ** cont)
+static inline int context_alloc(struct context ** cont, uint8_t type)
 {
-    (*cont) = mempool_alloc(&context_pool);
+    uint8_t class = stack_class_of[type];
+
+    (*cont) = mempool_alloc(&percpu_get(context_pool));
     if (unlikely(!(*cont)))
         return -1;
 
-    void * stack = mempool_alloc(&stack_pool);
+    void * stack = mempool_alloc(&percpu_get(stack_pools)[class]);
     if (unlikely(!stack)) {
-        mempool_free(&context_pool, (*cont));
+        mempool_free(&percpu_get(context_pool), (*cont));
         return -1;
     }
 
-    (*cont)->uc_stack.ss_sp = stack;
-    (*cont)->uc_stack.ss_size = sizeof(stack);
+    *(uint64_t *) stack = STACK_CANARY;
+    (*cont)->stack = stack;
+    (*cont)->type = type;
+    (*cont)->stack_class = class;
+    (*cont)->xsaved = 0;
+    /* XRSTOR faults unless the reserved header bytes are zero */
+    if (xstate_mask)
+        memset((uint8_t *) context_xstate(*cont) + 512, 0, 64);
     return 0;
 }
 
+/**
+ * context_check_stack - reports an overflow if the stack canary is gone
+ * @c: the context
+ */
+static inline void context_check_stack(struct context *c)
+{
+    if (unlikely(*(uint64_t *) c->stack != STACK_CANARY))
+        context_stack_overflow(c);
+}
+
 /**
  * context_free - frees a context and the associated stack
  * @c: the context
  */
-static inline void context_free(ucontext_t *c)
+static inline void context_free(struct context *c)
 {
-    mempool_free(&stack_pool, c->uc_stack.ss_sp);
-    mempool_free(&context_pool, c);
+    context_check_stack(c);
+    mempool_free(&percpu_get(stack_pools)[c->stack_class], c->stack);
+    mempool_free(&percpu_get(context_pool), c);
 }
 
 /**
- * set_context_link - sets the return context of a ucontext_t
+ * context_save_xstate - saves the vector state of a preempted context
  * @c: the context
- * @uc_link: the return context of c
+ *
+ * Must run before anything on the preemption path touches vector registers.
+ * Nothing is saved if every component is in its initial state; otherwise
+ * XSAVEC and XSAVEOPT still skip the components that are, so the cost
+ * follows what the handler actually used.
  */
-static inline void set_context_link(ucontext_t *c, ucontext_t *uc_link)
+static inline void context_save_xstate(struct context *c)
 {
-    uintptr_t *sp;
-    /* Set up the sp pointer so that we save uc_link in the correct address. */
-    sp = ((uintptr_t *) c->uc_stack.ss_sp + c->uc_stack.ss_size);
-    /* We assume that we have less than 6 arguments here. */
-    sp -= 1;
-    sp = (uintptr_t *) ((((uintptr_t) sp) & -16L) - 8);
-
-    c->uc_link = uc_link;
-    sp[1] = (uintptr_t) c->uc_link;
+    if (!xstate_mask)
+        return;
+    if (xstate_xinuse && !(xgetbv(1) & xstate_mask))
+        return;
+
+    switch (xstate_insn) {
+    case XSTATE_XSAVEC:
+        xsavec(context_xstate(c), xstate_mask);
+        break;
+    case XSTATE_XSAVEOPT:
+        xsaveopt(context_xstate(c), xstate_mask);
+        break;
+    default:
+        xsave(context_xstate(c), xstate_mask);
+        break;
+    }
+    c->xsaved = 1;
+}
+
+/**
+ * context_restore_xstate - restores the vector state of a context to resume
+ * @c: the context
+ */
+static inline void context_restore_xstate(struct context *c)
+{
+    if (!c->xsaved)
+        return;
+    xrstor(context_xstate(c), xstate_mask);
+    c->xsaved = 0;
+}
+
+/**
+ * context_make - prepares a context to run a function on its own stack
+ * @c: the context
+ * @fn: the function, which must not return
+ * @arg0: its first argument
+ * @arg1: its second argument
+ *
+ * The context starts in context_start(), which moves the arguments from
+ * callee-saved registers into place and calls @fn.
+ */
+static inline void context_make(struct context *c, void (*fn)(void *, void *),
+                                void *arg0, void *arg1)
+{
+    uintptr_t top = (uintptr_t) c->stack + stack_class_size[c->stack_class];
+
+    c->rsp = top & -16L;
+    c->rip = (uintptr_t) context_start;
+    c->r12 = (uintptr_t) fn;
+    c->r13 = (uintptr_t) arg0;
+    c->r14 = (uintptr_t) arg1;
+    c->mxcsr = MXCSR_DEFAULT;
+    c->fpucw = FPUCW_DEFAULT;
 }
@@ -20,16 +20,19 @@
  * THE SOFTWARE.
  */
 
+#pragma once
+
 #include <limits.h>
 #include <stdint.h>
 #include <ucontext.h>
 #include <stdio.h>
 
 #include <ix/cfg.h>
+#include <ix/cpu.h>
 #include <ix/mempool.h>
 #include <ix/ethqueue.h>
 
-#define MAX_WORKERS   18
+#define MAX_WORKERS   CFG_MAX_CPU
 
 #define WAITING     0x00
 #define ACTIVE      0x01
@@ -39,6 +42,12 @@
 #define PREEMPTED   0x02
 #define PROCESSED   0x03
 
+#define PREEMPT_IDLE    0x00    /* nothing running */
+#define PREEMPT_RUNNING 0x01    /* running, quantum clock on */
+#define PREEMPT_SENT    0x02    /* preemption IPI sent */
+#define PREEMPT_ACKED   0x03    /* IPI handled, preemption under way */
+#define PREEMPT_BATCH   0x04    /* running a batch, not preemptible */
+
 #define NOCONTENT   0x00
 #define PACKET      0x01
 #define CONTEXT     0x02
@@ -46,9 +55,9 @@
 #define MAX_UINT64  0xFFFFFFFFFFFFFFFF
 
 struct mempool_datastore task_datastore;
-struct mempool task_mempool __attribute((aligned(64)));
 struct mempool_datastore mcell_datastore;
-struct mempool mcell_mempool __attribute((aligned(64)));
+DECLARE_PERCPU(struct mempool, task_mempool);
+DECLARE_PERCPU(struct mempool, mcell_mempool);
 
 struct worker_response
 {
@@ -69,9 +78,43 @@ struct dispatcher_request
         uint8_t type;
         uint8_t category;
         uint64_t timestamp;
-        char make_it_64_bytes[30];
+        uint64_t quantum;       /* cycles, for workers timing themselves */
+        uint8_t batch;          /* requests batched behind this one */
+        char make_it_64_bytes[21];
 } __attribute__((packed, aligned(64)));
 
+/*
+ * Packets handed to a worker along with the one in its dispatcher_request,
+ * all of the same type. The worker runs them in order in the same context.
+ */
+struct request_batch
+{
+        void * mbufs[CFG_MAX_BATCH - 1];
+} __attribute__((aligned(64)));
+
+/*
+ * Preemption handshake with a worker. The dispatcher writes the sequence
+ * number of the request it wants to preempt (plus one) to @target before it
+ * sends the IPI. The handler acknowledges by copying it to @acked, or counts
+ * the IPI as @late if that request is no longer running.
+ */
+struct preempt_mailbox
+{
+        volatile uint64_t target;
+        volatile uint64_t acked;
+        volatile uint64_t handled;      /* TSC when the handler acknowledged */
+        volatile uint64_t late;
+} __attribute__((aligned(64)));
+
+/*
+ * Parking handshake with a worker. The dispatcher only parks an idle worker
+ * and only posts to it again after clearing @parked, which also wakes it.
+ */
+struct park_mailbox
+{
+        volatile uint64_t parked;
+} __attribute__((aligned(64)));
+
 struct networker_pointers_t
 {
         uint8_t cnt;
@@ -90,8 +133,6 @@ struct mbuf_queue {
         struct mbuf_cell * head;
 };
 
-struct mbuf_queue mqueue;
-
 static inline struct mbuf * mbuf_dequeue(struct mbuf_queue * mq)
 {
         struct mbuf_cell * tmp;
@@ -102,7 +143,7 @@ static inline struct mbuf * mbuf_dequeue(struct mbuf_queue * mq)
 
         buf = mq->head->buffer;
         tmp = mq->head;
-        mempool_free(&mcell_mempool, tmp);
+        mempool_free(&percpu_get(mcell_mempool), tmp);
         mq->head = mq->head->next;
 
         return buf;
@@ -112,145 +153,306 @@ static inline void mbuf_enqueue(struct mbuf_queue * mq, struct mbuf * buf)
 {
         if (unlikely(!buf))
                 return;
-        struct mbuf_cell * mcell = mempool_alloc(&mcell_mempool);
+        struct mbuf_cell * mcell = mempool_alloc(&percpu_get(mcell_mempool));
         mcell->buffer = buf;
         mcell->next = mq->head;
         mq->head = mcell;
 }
 
+#define TASKQ_SIZE          1024    /* must be a power of two */
+#define TASKQ_MASK          (TASKQ_SIZE - 1)
+
 struct task {
-        void * runnable;
+        void * runnable;        /* NULL until first preempted */
         void * mbuf;
         uint8_t type;
         uint8_t category;
+        uint8_t level;          /* feedback queue level */
+        uint8_t batch;          /* packets batched behind it on a worker */
+        int16_t last_worker;    /* worker it was preempted on, or -1 */
         uint64_t timestamp;
-        struct task * next;
+        uint64_t attained;      /* service received before a preemption */
+        uint64_t enqueued;      /* when it entered its feedback queue level */
+        uint64_t deadline;      /* when it is no longer worth running */
 };
 
+struct task_cell {
+        struct task task;
+        struct task_cell * next;
+};
+
+/*
+ * A task queue is a bounded ring of inline task records, so that enqueueing
+ * and dequeueing on the dispatcher never allocates or chases pointers. Tasks
+ * that do not fit in the ring spill over into a mempool-backed list; the
+ * overflow always holds the newest tasks, so it refills the ring tail as
+ * slots free up and FIFO order is preserved.
+ */
 struct task_queue
 {
-        struct task * head;
-        struct task * tail;
-};
-        
-struct task_queue tskq[CFG_MAX_PORTS];
+        uint32_t head;
+        uint32_t tail;
+        uint32_t overflow_len;
+        struct task_cell * overflow_head;
+        struct task_cell * overflow_tail;
+        struct task ring[TASKQ_SIZE];
+} __attribute__((aligned(64)));
+
+#define SERVICE_HIST_BUCKETS 64
+
+/*
+ * Each dispatcher core owns a shard: a contiguous range of workers and the
+ * task queues that feed them. Only the owning dispatcher touches the queues;
+ * @load is published so that the networker can steer new packets towards the
+ * least loaded shard.
+ */
+struct dispatcher_shard {
+        int id;
+        int first_worker;
+        int num_workers;
+        int num_active;         /* workers not parked, the first ones */
+        int min_active;         /* workers never parked */
+        struct task_queue tskq[CFG_MAX_PORTS];
+        /* feedback queue levels 1 and below; level 0 is tskq */
+        struct task_queue mlfq[CFG_MAX_MLFQ_LEVELS - 1];
+        struct mbuf_queue mqueue;
+        /* per type preemption quantum, in cycles */
+        uint64_t quantum[CFG_MAX_PORTS];
+        /* per type log2 histogram of service times, for adaptive quanta */
+        uint32_t service_hist[CFG_MAX_PORTS][SERVICE_HIST_BUCKETS];
+        uint32_t service_samples[CFG_MAX_PORTS];
+        /* per type requests refused by admission control */
+        uint64_t rejected[CFG_MAX_PORTS];
+        /* preemptions triggered by urgent arrivals */
+        uint64_t urgent_preemptions;
+        /* expired tasks dropped before running / after a preemption */
+        uint64_t expired_queued;
+        uint64_t expired_preempted;
+        /* per type partitioning: workers holding the type, capped types */
+        bool partitioned;
+        uint32_t running[CFG_MAX_PORTS];
+        uint32_t capped;
+        /* other types run on / preempted from reserved workers */
+        uint64_t borrowed;
+        uint64_t reclaims;
+        /* replies sent by the dispatcher and not yet flushed */
+        int unsent_replies;
+        /* preemption IPIs sent, re-sent and acknowledged */
+        uint64_t ipis_sent;
+        uint64_t ipi_resends;
+        uint64_t ipis_acked;
+        uint64_t ipi_latency;   /* cycles from send to handler, summed */
+        /* preempted contexts resumed on the same / another worker */
+        uint64_t affinity_hits;
+        uint64_t affinity_misses;
+        /* workers parked and woken up */
+        uint64_t parks;
+        uint64_t unparks;
+        /* handoffs carrying a batch, and the packets batched behind them */
+        uint64_t batches;
+        uint64_t batched;
+        /* packets received, and the totals at the last stats report */
+        uint64_t received;
+        uint64_t report_received;
+        uint64_t report_completed;
+        uint64_t report_time;
+        /* last worker_status seen, indexed like worker_status */
+        uint8_t status_seen[MAX_WORKERS] __attribute__((aligned(16)));
+        volatile uint64_t load __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct dispatcher_shard shards[CFG_MAX_DISPATCHERS];
 
-static inline void tskq_enqueue_head(struct task_queue * tq, void * rnbl,
-                                     void * mbuf, uint8_t type,
-                                     uint8_t category, uint64_t timestamp)
+/*
+ * Core layout: CFG.cpu[0] runs dispatcher 0, CFG.cpu[1] the networker,
+ * the next CFG.num_dispatchers - 1 entries the remaining dispatchers and
+ * everything after that is a worker. With a fused networker, there is no
+ * networker core and workers start at CFG.cpu[1].
+ */
+static inline int worker_cpu_offset(void)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
-        tsk->runnable = rnbl;
-        tsk->mbuf = mbuf;
-        tsk->type = type;
-        tsk->category = category;
-        tsk->timestamp = timestamp;
-        if (tq->head != NULL) {
-            struct task * tmp = tq->head;
-            tq->head = tsk;
-            tsk->next = tmp;
-        } else {
-            tq->head = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        }
+        return CFG.num_dispatchers + (CFG.fused_networker ? 0 : 1);
 }
 
-static inline void tskq_enqueue_tail(struct task_queue * tq, void * rnbl,
-                                     void * mbuf, uint8_t type,
-                                     uint8_t category, uint64_t timestamp)
+static inline int num_workers(void)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
-        if (!tsk)
-                return;
-        tsk->runnable = rnbl;
-        tsk->mbuf = mbuf;
-        tsk->type = type;
-        tsk->category = category;
-        tsk->timestamp = timestamp;
-        if (tq->head != NULL) {
-            tq->tail->next = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        } else {
-            tq->head = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        }
+        return CFG.num_cpus - worker_cpu_offset();
+}
+
+static inline unsigned int worker_cpu(int worker)
+{
+        return CFG.cpu[worker + worker_cpu_offset()];
+}
+
+static inline uint32_t tskq_ring_len(struct task_queue * tq)
+{
+        return tq->tail - tq->head;
+}
+
+/**
+ * tskq_len - returns the number of tasks in a queue, overflow included
+ * @tq: the task queue
+ */
+static inline uint32_t tskq_len(struct task_queue * tq)
+{
+        return tskq_ring_len(tq) + tq->overflow_len;
 }
 
-static inline int tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
-                                void ** mbuf, uint8_t *type, uint8_t *category,
-                                uint64_t *timestamp)
+static inline int tskq_overflow_push_tail(struct task_queue * tq,
+                                          struct task * tsk)
 {
-        if (tq->head == NULL)
-            return -1;
-        (*rnbl_ptr) = tq->head->runnable;
-        (*mbuf) = tq->head->mbuf;
-        (*type) = tq->head->type;
-        (*category) = tq->head->category;
-        (*timestamp) = tq->head->timestamp;
-        struct task * tsk = tq->head;
-        tq->head = tq->head->next;
-        mempool_free(&task_mempool, tsk);
-        if (tq->head == NULL)
-                tq->tail = NULL;
+        struct task_cell * cell = mempool_alloc(&percpu_get(task_mempool));
+        if (unlikely(!cell))
+                return -1;
+        cell->task = *tsk;
+        cell->next = NULL;
+        if (tq->overflow_tail)
+                tq->overflow_tail->next = cell;
+        else
+                tq->overflow_head = cell;
+        tq->overflow_tail = cell;
+        tq->overflow_len++;
         return 0;
 }
 
-static inline uint64_t get_queue_timestamp(struct task_queue * tq, uint64_t * timestamp)
+static inline int tskq_overflow_push_head(struct task_queue * tq,
+                                          struct task * tsk)
 {
-        if (tq->head == NULL)
-            return -1;
-        (*timestamp) = tq->head->timestamp;
+        struct task_cell * cell = mempool_alloc(&percpu_get(task_mempool));
+        if (unlikely(!cell))
+                return -1;
+        cell->task = *tsk;
+        cell->next = tq->overflow_head;
+        if (!tq->overflow_tail)
+                tq->overflow_tail = cell;
+        tq->overflow_head = cell;
+        tq->overflow_len++;
         return 0;
 }
 
-static inline int naive_tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
-                                     void ** mbuf, uint8_t *type,
-                                     uint8_t *category, uint64_t *timestamp)
+static inline void tskq_overflow_refill(struct task_queue * tq)
 {
-        int i;
-        for (i = 0; i < CFG.num_ports; i++) {
-                if(tskq_dequeue(&tq[i], rnbl_ptr, mbuf, type, category,
-                                timestamp) == 0)
-                        return 0;
-        }
-        return -1;
+        struct task_cell * cell = tq->overflow_head;
+
+        tq->ring[tq->tail++ & TASKQ_MASK] = cell->task;
+        tq->overflow_head = cell->next;
+        if (!tq->overflow_head)
+                tq->overflow_tail = NULL;
+        tq->overflow_len--;
+        mempool_free(&percpu_get(task_mempool), cell);
 }
 
-static inline int smart_tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
-                                     void ** mbuf, uint8_t *type,
-                                     uint8_t *category, uint64_t *timestamp,
-                                     uint64_t cur_time)
+/**
+ * tskq_enqueue_head - inserts a task at the front of a queue
+ * @tq: the task queue
+ * @tsk: the task, copied into the queue
+ *
+ * If the ring is full its newest task is moved to the overflow list to make
+ * room. Returns 0 on success, -1 if the overflow list cannot grow.
+ */
+static inline int tskq_enqueue_head(struct task_queue * tq, struct task * tsk)
 {
-        int i, ret;
-        uint64_t queue_stamp;
-        int index = -1;
-        double max = 0;
-
-        for (i = 0; i < CFG.num_ports; i++) {
-                ret = get_queue_timestamp(&tq[i], &queue_stamp);
-                if (ret)
-                        continue;
-
-                int64_t diff = cur_time - queue_stamp;
-                double current = diff / CFG.slos[i];
-                if (current > max) {
-                        max = current;
-                        index = i;
-                }
+        if (unlikely(tskq_ring_len(tq) == TASKQ_SIZE)) {
+                if (tskq_overflow_push_head(tq,
+                                            &tq->ring[(tq->tail - 1) & TASKQ_MASK]))
+                        return -1;
+                tq->tail--;
         }
+        tq->ring[--tq->head & TASKQ_MASK] = *tsk;
+        return 0;
+}
 
-        if (index != -1) {
-                return tskq_dequeue(&tq[index], rnbl_ptr, mbuf, type, category,
-                                    timestamp);
-        }
-        return -1;
+/**
+ * tskq_enqueue_tail - appends a task to a queue
+ * @tq: the task queue
+ * @tsk: the task, copied into the queue
+ *
+ * Returns 0 on success, -1 if the ring is full and the overflow list cannot
+ * grow.
+ */
+static inline int tskq_enqueue_tail(struct task_queue * tq, struct task * tsk)
+{
+        if (unlikely(tq->overflow_head || tskq_ring_len(tq) == TASKQ_SIZE))
+                return tskq_overflow_push_tail(tq, tsk);
+        tq->ring[tq->tail++ & TASKQ_MASK] = *tsk;
+        return 0;
+}
+
+/**
+ * tskq_dequeue - removes the task at the front of a queue
+ * @tq: the task queue
+ * @tsk: where to copy the task
+ *
+ * Returns 0 on success, -1 if the queue is empty.
+ */
+static inline int tskq_dequeue(struct task_queue * tq, struct task * tsk)
+{
+        if (tq->head == tq->tail)
+                return -1;
+        (*tsk) = tq->ring[tq->head++ & TASKQ_MASK];
+        if (unlikely(tq->overflow_head))
+                tskq_overflow_refill(tq);
+        return 0;
 }
 
+/**
+ * tskq_peek - returns the task at the front of a queue without removing it
+ * @tq: the task queue
+ *
+ * Returns NULL if the queue is empty.
+ */
+static inline struct task * tskq_peek(struct task_queue * tq)
+{
+        if (tq->head == tq->tail)
+                return NULL;
+        return &tq->ring[tq->head & TASKQ_MASK];
+}
+
+/*
+ * Each worker has a ring of CFG.handoff_depth request and response slots. The
+ * dispatcher posts requests into consecutive slots and the worker serves them
+ * in order, answering in the response slot of the same index, so that the
+ * next request is already staged when the current one completes. A staged
+ * request is claimed by the worker by flipping its flag from ACTIVE back to
+ * WAITING; until then the dispatcher can revoke it the same way.
+ */
+struct handoff {
+        uint64_t posted;        /* requests posted to the worker */
+        uint64_t completed;     /* responses consumed by the dispatcher */
+        struct task inflight[CFG_MAX_HANDOFF_DEPTH];
+};
+
+static inline unsigned int handoff_slot(uint64_t seq)
+{
+        return seq & (CFG.handoff_depth - 1);
+}
+
+/*
+ * A preempted context held back for the worker it last ran on, until
+ * @expires. Dispatcher private.
+ */
+struct affinity_slot {
+        uint64_t expires;       /* 0 if the slot is empty */
+        struct task task;
+};
+
 uint64_t timestamps[MAX_WORKERS];
-uint8_t preempt_check[MAX_WORKERS];
-volatile struct networker_pointers_t networker_pointers;
-volatile struct worker_response worker_responses[MAX_WORKERS];
-volatile struct dispatcher_request dispatcher_requests[MAX_WORKERS];
\ No newline at end of file
+uint64_t quantum[MAX_WORKERS];
+uint64_t ipi_sent[MAX_WORKERS];
+uint8_t preempt_state[MAX_WORKERS];
+struct handoff handoffs[MAX_WORKERS];
+struct affinity_slot affinity[MAX_WORKERS];
+uint32_t worker_types[MAX_WORKERS];     /* types a worker runs by default */
+volatile struct networker_pointers_t networker_pointers[CFG_MAX_DISPATCHERS];
+struct preempt_mailbox preempt_mailboxes[MAX_WORKERS];
+struct park_mailbox park_mailboxes[MAX_WORKERS];
+/*
+ * Bumped by a worker after each response it posts, so that the dispatcher
+ * can find the workers with new responses without reading their slots.
+ */
+volatile uint8_t worker_status[MAX_WORKERS] __attribute__((aligned(64)));
+volatile struct worker_response
+        worker_responses[MAX_WORKERS][CFG_MAX_HANDOFF_DEPTH];
+volatile struct dispatcher_request
+        dispatcher_requests[MAX_WORKERS][CFG_MAX_HANDOFF_DEPTH];
+struct request_batch request_batches[MAX_WORKERS][CFG_MAX_HANDOFF_DEPTH];
\ No newline at end of file
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * handler.h - application request handlers
+ *
+ * Each request type (the index of its port in the configuration) runs the
+ * handler registered for it. Handlers are registered at startup, either by
+ * code linked into the binary or by a shared library named by handler_path,
+ * whose HANDLER_INIT_SYMBOL function is called once during initialization.
+ *
+ * A handler runs in the context of its request and may be preempted and
+ * resumed on another worker at any point where interrupts are enabled, or at
+ * yield_check() in the cooperative preemption mode. It gets the payload in
+ * place in the receive buffer, and builds its response with reply_buf() and
+ * reply_send().
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ix/cfg.h>
+#include <ix/syscall.h>
+
+/* largest response payload a handler can build */
+#define REPLY_MAX_LEN           1024
+
+#define HANDLER_INIT_SYMBOL     "shinjuku_handlers_init"
+
+struct request_view {
+        const void * data;      /* UDP payload, in the receive buffer */
+        size_t len;
+        uint8_t type;
+};
+
+struct reply {
+        struct ip_tuple * id;   /* the flow the request came in on */
+        void * buf;             /* response buffer, or NULL */
+};
+
+typedef void (*request_handler_t)(const struct request_view * req,
+                                  struct reply * rep);
+
+extern request_handler_t handlers[CFG_MAX_PORTS];
+
+extern int handler_register(uint8_t type, request_handler_t fn);
+extern void * reply_buf(struct reply * rep);
+extern int reply_send(struct reply * rep, size_t len);
+extern void reply_discard(struct reply * rep);
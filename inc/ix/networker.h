@@ -27,9 +27,29 @@
 #pragma once
 
 #include <ix/log.h>
+#include <ix/mbuf.h>
 
 #include <net/ip.h>
 #include <net/udp.h>
+#include <net/ethernet.h>
+
+struct response {
+        uint64_t runNs;
+        uint64_t genNs;
+};
+
+struct request {
+        uint64_t runNs;
+        uint64_t genNs;
+};
+
+/* runNs of the reply to a request refused by admission control */
+#define RESPONSE_REJECTED  (~0UL)
+/* runNs of the reply to a request dropped after its deadline */
+#define RESPONSE_TIMED_OUT (~1UL)
+
+extern int networker_recv(struct mbuf ** pkts, uint8_t * types);
+extern void networker_free(struct mbuf * pkt);
 
 static inline void serve(void * data, uint16_t len, struct ip_tuple * id)
 {
@@ -46,3 +66,41 @@ static inline void serve(void * data, uint16_t len, struct ip_tuple * id)
                  "source port %d, dest port %d, len %d\n",
                  src, dst, id->src_port, id->dst_port, len);
 }
+
+static inline void parse_packet(struct mbuf * pkt, void ** data_ptr,
+                                struct ip_tuple ** id_ptr)
+{
+        // Quickly parse packet without doing checks
+        struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
+        struct ip_hdr *  iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
+        int hdrlen = iphdr->header_len * sizeof(uint32_t);
+        struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
+                                                 hdrlen);
+        // Get data and udp header
+        (*data_ptr) = mbuf_nextd(udphdr, void *);
+        uint16_t len = ntoh16(udphdr->len);
+
+        if (unlikely(!mbuf_enough_space(pkt, udphdr, len))) {
+                log_warn("udp: not enough space in mbuf\n");
+                (*data_ptr) = NULL;
+                return;
+        }
+
+        (*id_ptr) = mbuf_mtod(pkt, struct ip_tuple *);
+        (*id_ptr)->src_ip = ntoh32(iphdr->src_addr.addr);
+        (*id_ptr)->dst_ip = ntoh32(iphdr->dst_addr.addr);
+        (*id_ptr)->src_port = ntoh16(udphdr->src_port);
+        (*id_ptr)->dst_port = ntoh16(udphdr->dst_port);
+        pkt->done = (void *) 0xDEADBEEF;
+}
+
+/**
+ * packet_data_len - gets the length of the payload found by parse_packet()
+ * @data: the payload
+ */
+static inline size_t packet_data_len(void * data)
+{
+        struct udp_hdr * udphdr = (struct udp_hdr *) data - 1;
+
+        return ntoh16(udphdr->len) - sizeof(struct udp_hdr);
+}
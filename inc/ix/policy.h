@@ -0,0 +1,132 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * policy.h - dispatcher scheduling policies
+ *
+ * A policy ranks the task at the head of every type queue; the dispatcher
+ * hands the highest ranked one to the next free worker. The active policy is
+ * selected with the 'policy' key of the configuration file.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/cfg.h>
+#include <ix/dispatch.h>
+
+struct sched_policy {
+        const char * name;
+        /* priority of a queued task, higher runs first */
+        uint64_t (*rank)(struct task * tsk, uint64_t cur_time);
+};
+
+extern const struct sched_policy * policy_find(const char * name);
+extern const struct sched_policy * sched_policy;
+
+/* per type service time estimates, in cycles */
+extern uint64_t service_estimate[CFG_MAX_PORTS];
+
+/* a set of request types, one bit per type */
+#define TYPES_ALL       (~0U)
+
+/**
+ * policy_select_mask - selects the queue to serve next among some types
+ * @tq: the per type task queues
+ * @types: the set of types that may be served
+ * @cur_time: the current time
+ *
+ * Returns the index of the queue, or -1 if all eligible queues are empty.
+ */
+static inline int policy_select_mask(struct task_queue * tq, uint32_t types,
+                                     uint64_t cur_time)
+{
+        int i, index = -1;
+        uint64_t rank, max = 0;
+        struct task * tsk;
+
+        for (i = 0; i < CFG.num_ports; i++) {
+                if (!(types & (1U << i)))
+                        continue;
+                tsk = tskq_peek(&tq[i]);
+                if (!tsk)
+                        continue;
+
+                rank = sched_policy->rank(tsk, cur_time);
+                if (index == -1 || rank > max) {
+                        max = rank;
+                        index = i;
+                }
+        }
+        return index;
+}
+
+/**
+ * policy_select - selects the queue to serve next
+ * @tq: the per type task queues
+ * @cur_time: the current time
+ *
+ * Returns the index of the queue, or -1 if all queues are empty.
+ */
+static inline int policy_select(struct task_queue * tq, uint64_t cur_time)
+{
+        return policy_select_mask(tq, TYPES_ALL, cur_time);
+}
+
+/**
+ * policy_dequeue_mask - dequeues the task the policy wants to run next
+ * @tq: the per type task queues
+ * @types: the set of types that may be served
+ * @tsk: where to copy the task
+ * @cur_time: the current time
+ *
+ * Returns 0 on success, -1 if all eligible queues are empty.
+ */
+static inline int policy_dequeue_mask(struct task_queue * tq, uint32_t types,
+                                      struct task * tsk, uint64_t cur_time)
+{
+        int index = policy_select_mask(tq, types, cur_time);
+
+        if (index == -1)
+                return -1;
+        return tskq_dequeue(&tq[index], tsk);
+}
+
+/**
+ * policy_completed - learns from the total service time of a finished task
+ * @type: the request type
+ * @service: the service time in cycles
+ *
+ * Keeps an exponentially weighted moving average (alpha = 1/8) per type.
+ * Shards update the estimates without synchronization; a lost update only
+ * delays convergence.
+ */
+static inline void policy_completed(uint8_t type, uint64_t service)
+{
+        int64_t est = service_estimate[type];
+
+        if (!est)
+                service_estimate[type] = service;
+        else
+                service_estimate[type] = est + (((int64_t) service - est) >> 3);
+}
@@ -117,5 +117,29 @@ extern int timer_init(void);
 
 extern int cycles_per_us;
 
+/*
+ * TSC timebase: every configured time is converted to TSC cycles once, at
+ * startup, so that hot paths only compare integers. Only valid after
+ * timer_init() has calibrated cycles_per_us.
+ */
+
+/**
+ * ns_to_cycles - converts nanoseconds to TSC cycles
+ * @ns: the time in nanoseconds
+ */
+static inline uint64_t ns_to_cycles(uint64_t ns)
+{
+	return ns * cycles_per_us / 1000;
+}
+
+/**
+ * cycles_to_ns - converts TSC cycles to nanoseconds
+ * @cycles: the time in cycles
+ */
+static inline uint64_t cycles_to_ns(uint64_t cycles)
+{
+	return cycles * 1000 / cycles_per_us;
+}
+
 
 
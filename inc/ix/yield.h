@@ -0,0 +1,66 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * yield.h - cooperative preemption points
+ *
+ * In the cooperative preemption mode workers take no interrupts. Request
+ * handlers instead call yield_check() at loop back-edges and other points
+ * where they can be preempted; once the quantum of the running request has
+ * expired, it gives the worker back to the dispatcher exactly like the
+ * preemption interrupt would, and returns when the request is resumed. A
+ * check is a TSC read and a compare against a thread-local deadline, which
+ * never expires in the other preemption modes.
+ *
+ * Only preemption stops depending on Dune in this mode: workers still run
+ * in Dune, disable interrupts with cli and use its page tables and
+ * per-cpu setup, so the dataplane does not run on hosts without Dune.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/compiler.h>
+#include <asm/cpu.h>
+
+extern __thread uint64_t yield_deadline;
+
+extern void yield_now(void);
+
+static inline void yield_check(void)
+{
+        if (unlikely(rdtsc() >= yield_deadline))
+                yield_now();
+}
+
+/*
+ * YIELD_CHECK_EVERY - calls yield_check() on one out of @n iterations of a
+ * loop counted by @i, for loops whose bodies are shorter than a TSC read.
+ * @n must be a power of two.
+ */
+#define YIELD_CHECK_EVERY(i, n)                         \
+        do {                                            \
+                if (!((i) & ((n) - 1)))                 \
+                        yield_check();                  \
+        } while (0)